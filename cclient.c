@@ -10,6 +10,9 @@
  *    containing the client’s handle.
  *  - Then reads STDIN commands (%M, %B, %C, %L) and builds packets per the spec.
  *  - It also processes incoming packets (forwarded messages, error packets, list responses).
+ *  - It remembers the ids of the peers named in list and presence responses, and sends
+ *    %M and %C to peers it knows the ids of by id (flag=8, flag=9), which the server
+ *    resolves without looking up any handle.
  *
  * Author: Robin Simpson
  * Lab Section: 3pm
@@ -28,12 +31,36 @@
 /* Define maximum buffer size for reading/writing and maximum handle length */
 #define MAXBUF    1400     // Maximum size for message buffer
 #define MAX_HANDLE 100     // Maximum allowed length for a client handle
+#define LIST_PACKED 0x01   // List request option: handles packed into flag=15 packets
+#define LIST_IDS    0x02   // List request option: each handle followed by its 4-byte id
+#define LIST_OPTIONS (LIST_PACKED | LIST_IDS)  // The options this client always asks for
+#define PEER_BUCKETS 1024  // Chains in the peer id cache
 
 /* Global variables */
 /* clientHandle stores the username/handle of this client; extra byte for the null terminator */
 char clientHandle[MAX_HANDLE+1] = {0};
+
+/* clientId is the numeric id the server assigned at registration (0 if it sent none) */
+uint32_t clientId = 0;
+/* listing is set while a list response (flag=11 up to flag=13) is arriving */
+int listing = 0;
+/* listPageSize is the page size of a paged listing (%L -p) in progress, 0 if none;
+ * listTotal counts the handles its pages have held so far */
+uint32_t listPageSize = 0;
+uint32_t listTotal = 0;
+/* presenceVersion is the membership version last seen while subscribed to presence
+ * deltas (%P), 0 if not subscribed */
+uint32_t presenceVersion = 0;
 /* Optional client ID; if provided on the command line, stored here */
 int myClientID = 0;
+/* peerIds caches the id of every peer handle seen in a list or presence response,
+ * hashed by handle; an entry goes when its peer leaves or its id is refused */
+struct peerId {
+    struct peerId *next;
+    uint32_t id;
+    char handle[MAX_HANDLE+1];
+};
+struct peerId *peerIds[PEER_BUCKETS] = {0};
 
 /* Forward declarations of functions used only in this file */
 static void checkArgs(int argc, char *argv[]);
@@ -43,18 +70,28 @@ static void clientControlLoop(int socketNum);
 static void processUserInput(int socketNum);
 static void processSocketData(int socketNum);
 static void handleCommand(const char *input, int socketNum);
+static void sendPagedListRequest(int socketNum, const uint8_t *cursor, uint8_t cursorLen);
+static void sendPresenceRequest(int socketNum, uint8_t subscribe);
+static struct peerId **findPeerId(const char *handle);
+static void rememberPeerId(const char *handle, uint32_t id);
+static void forgetPeerId(const char *handle);
+static uint32_t lookupPeerId(const char *handle);
 
 /*
  * checkArgs:
  *   Validates the command-line arguments.
  *   Ensures the usage is: chatClient <handle> <server-name> <server-port> [clientID]
- *   Also checks that the provided handle does not exceed MAX_HANDLE characters.
+ *   Also checks that the provided handle is not empty and does not exceed MAX_HANDLE characters.
  */
 static void checkArgs(int argc, char *argv[]) {
     if (argc < 4 || argc > 5) {
         fprintf(stderr, "usage: %s <handle> <server-name> <server-port> [clientID]\n", argv[0]);
         exit(1);
     }
+    if (strlen(argv[1]) == 0) {
+        fprintf(stderr, "Invalid handle, handle must not be empty\n");
+        exit(1);
+    }
     if (strlen(argv[1]) > MAX_HANDLE) {
         fprintf(stderr, "Invalid handle, handle longer than 100 characters: %s\n", argv[1]);
         exit(1);
@@ -68,28 +105,23 @@ static void checkArgs(int argc, char *argv[]) {
  *     [flag=1] [1-byte handle length] [handle (without null terminator)]
  */
 static void sendRegistration(int socketNum) {
-    uint8_t buf[1 + 1 + MAX_HANDLE]; // Buffer for registration packet: flag + length + handle
-    int offset = 0;                  // Offset to keep track of the current buffer position
+    uint8_t head[2];                 // Flag + handle length; the handle itself is sent from clientHandle
 
-    buf[offset++] = 1;               // Registration flag: flag = 1
+    head[0] = 1;                     // Registration flag: flag = 1
 
     // Get the length of the client handle and add it to the packet
-    uint8_t hlen = (uint8_t) strlen(clientHandle);
-    buf[offset++] = hlen;
+    head[1] = (uint8_t) strlen(clientHandle);
 
-    // Copy the client handle into the buffer (without the null terminator)
-    memcpy(buf + offset, clientHandle, hlen);
-    offset += hlen;
-
-    // Send the registration packet to the server
-    sendPDU(socketNum, buf, offset);
+    // Send the registration packet to the server (handle without the null terminator)
+    struct iovec parts[2] = { { head, 2 }, { clientHandle, head[1] } };
+    sendPDUv(socketNum, parts, 2);
 }
 
 /*
  * processRegistrationResponse:
  *   Processes the server's response to the registration packet.
  *   The server's response must contain at least one byte indicating the response flag:
- *     - flag == 2: Registration accepted.
+ *     - flag == 2: Registration accepted, followed by the 4-byte client id (network order).
  *     - flag == 3: Registration error (e.g., duplicate handle).
  *   Any unknown flag results in an error message and client exit.
  */
@@ -97,7 +129,13 @@ static void processRegistrationResponse(uint8_t *buffer, int len) {
     if (len < 1) return;             // Ensure there's at least one byte in the response
     uint8_t flag = buffer[0];        // Extract the flag from the response
     if (flag == 2) {
-        // Registration accepted; nothing further is needed.
+        // Registration accepted; keep the id if the server sent one.
+        if (len >= 1 + 4) {
+            uint32_t id_net;
+            memcpy(&id_net, buffer + 1, 4);
+            clientId = ntohl(id_net);
+            rememberPeerId(clientHandle, clientId);
+        }
         return;
     } else if (flag == 3) {
         // Registration error: the handle is already in use.
@@ -148,6 +186,10 @@ static void processUserInput(int socketNum) {
  *           [flag=5] [1-byte sender handle length] [sender handle]
  *           [1-byte destination count (1)] [1-byte destination handle length] [destination handle]
  *           [null-terminated text message]
+ *        or, if the destination's id is known:
+ *           [flag=8] [1-byte sender handle length] [sender handle]
+ *           [1-byte destination count (1)] [4-byte destination id, network order]
+ *           [null-terminated text message]
  *
  *   %B - Broadcast message: Format is "%B [text]"
  *        Packet format:
@@ -161,10 +203,25 @@ static void processUserInput(int socketNum) {
  *           For each destination:
  *             [1-byte destination handle length] [destination handle]
  *           [null-terminated text message]
+ *        or, if the ids of all the destinations are known, flag=9 with a 4-byte
+ *        id (network order) for each destination instead of its handle.
+ *
+ *   %L - List request: Format is "%L" for every handle, "%L prefix [max]" for at most
+ *        max (default: no limit) of the handles starting with prefix, or "%L -p N" for
+ *        every handle, fetched N at a time
+ *        Packet format:
+ *           [flag=10] [options=3 (packed response, with ids)]
+ *        or, with a prefix:
+ *           [flag=14] [1-byte prefix length] [prefix] [4-byte max count, network order, 0 = no limit]
+ *           [options=3 (packed response, with ids)]
+ *        or, paged (see sendPagedListRequest()):
+ *           [flag=16] [1-byte cursor length] [cursor] [4-byte page size, network order]
+ *           [options=3 (packed response, with ids)]
  *
- *   %L - List request: Format is simply "%L"
+ *   %P - Presence: Format is "%P" to list the handles and then be told of every join and
+ *        leave, "%P off" to stop
  *        Packet format:
- *           [flag=10]
+ *           [flag=18] [1-byte subscribe (1) or unsubscribe (0)] [options=3 (packed response, with ids)]
  *
  *   If the command is not recognized, an error message is printed.
  */
@@ -175,7 +232,8 @@ static void handleCommand(const char *input, int socketNum) {
         printf("%%M <dest_handle> <text>\n");
         printf("%%B <text>\n");
         printf("%%C <num> <dest1> <dest2> ... <destN> <text>\n");
-        printf("%%L\n");
+        printf("%%L [prefix [max]] | %%L -p <page-size>\n");
+        printf("%%P [off]\n");
         printf("%%h\n");
         printf("$: ");
         fflush(stdout);
@@ -207,33 +265,35 @@ static void handleCommand(const char *input, int socketNum) {
          *   [flag=5] [1-byte sender handle length] [sender handle]
          *   [1-byte destination count (should be 1)] [1-byte destination handle length] [destination handle]
          *   [null-terminated text message]
+         * or, with the destination's id known, flag=8 with the 4-byte id in place of
+         * the destination handle (and its length).
          */
-        uint8_t buf[MAXBUF];
-        int offset = 0;
-        buf[offset++] = 5; // Private message flag
-
-        // Append sender handle
-        uint8_t shLen = (uint8_t) strlen(clientHandle);
-        buf[offset++] = shLen;
-        memcpy(buf + offset, clientHandle, shLen);
-        offset += shLen;
-
-        // Specify that there is exactly one destination
-        buf[offset++] = 1;
-
-        // Append destination handle
-        uint8_t dhLen = (uint8_t) strlen(destHandle);
-        buf[offset++] = dhLen;
-        memcpy(buf + offset, destHandle, dhLen);
-        offset += dhLen;
-
-        // Append the text message, including the null terminator
-        int textLen = strlen(text) + 1;
-        memcpy(buf + offset, text, textLen);
-        offset += textLen;
-
-        // Send the private message packet to the server
-        sendPDU(socketNum, buf, offset);
+        uint32_t destId = lookupPeerId(destHandle);
+        uint32_t destId_net = htonl(destId);
+
+        // Flag and sender handle length
+        uint8_t head[2];
+        head[0] = destId ? 8 : 5; // Private message (by id) flag
+        head[1] = (uint8_t) strlen(clientHandle);
+
+        // Exactly one destination, then the destination handle length
+        uint8_t dest[2];
+        dest[0] = 1;
+        dest[1] = (uint8_t) strlen(destHandle);
+
+        // Send the private message packet to the server; the pieces are gathered
+        // straight from their buffers, text including the null terminator
+        struct iovec parts[5] = {
+            { head, 2 }, { clientHandle, head[1] },
+            { dest, 2 }, { destHandle, dest[1] },
+            { text, strlen(text) + 1 }
+        };
+        if (destId) {
+            parts[2].iov_len = 1;
+            parts[3] = (struct iovec) { &destId_net, 4 };
+        }
+        if (sendPDUv(socketNum, parts, 5) < 0)
+            printf("Message too long, not sent\n");
         free(copy);
     }
     else if (cmd == 'B') {
@@ -248,23 +308,15 @@ static void handleCommand(const char *input, int socketNum) {
         char *text = strtok(NULL, "\n");  // Get the text message (if any)
         if (!text) text = "";
         
-        uint8_t buf[MAXBUF];
-        int offset = 0;
-        buf[offset++] = 4; // Broadcast flag
-
-        // Append sender handle
-        uint8_t shLen = (uint8_t) strlen(clientHandle);
-        buf[offset++] = shLen;
-        memcpy(buf + offset, clientHandle, shLen);
-        offset += shLen;
-
-        // Append the text message with its null terminator
-        int textLen = strlen(text) + 1;
-        memcpy(buf + offset, text, textLen);
-        offset += textLen;
-
-        // Send the broadcast packet to the server
-        sendPDU(socketNum, buf, offset);
+        // Flag and sender handle length
+        uint8_t head[2];
+        head[0] = 4; // Broadcast flag
+        head[1] = (uint8_t) strlen(clientHandle);
+
+        // Send the broadcast packet to the server: sender handle, then the text with its null terminator
+        struct iovec parts[3] = { { head, 2 }, { clientHandle, head[1] }, { text, strlen(text) + 1 } };
+        if (sendPDUv(socketNum, parts, 3) < 0)
+            printf("Message too long, not sent\n");
         free(copy);
     }
     else if (cmd == 'C') {
@@ -314,45 +366,100 @@ static void handleCommand(const char *input, int socketNum) {
         char *text = strtok(NULL, "\n");
         if (!text) text = "";
         
-        uint8_t buf[MAXBUF];
-        int offset = 0;
-        buf[offset++] = 6; // Multicast flag
+        // Addressed by id (flag=9) only if every destination's id is known
+        uint32_t destIds[10];
+        int byId = 1;
+        for (int i = 0; i < numHandles; i++) {
+            destIds[i] = htonl(lookupPeerId(destHandles[i]));
+            if (destIds[i] == 0)
+                byId = 0;
+        }
 
-        // Append sender handle
-        uint8_t shLen = (uint8_t) strlen(clientHandle);
-        buf[offset++] = shLen;
-        memcpy(buf + offset, clientHandle, shLen);
-        offset += shLen;
+        // Flag, sender handle length, then (after the handle) the number of destinations
+        uint8_t head[2];
+        head[0] = byId ? 9 : 6; // Multicast (by id) flag
+        head[1] = (uint8_t) strlen(clientHandle);
+        uint8_t count = (uint8_t) numHandles;
 
-        // Append the number of destination handles
-        buf[offset++] = (uint8_t) numHandles;
+        struct iovec parts[3 + 2 * 9 + 1];
+        int n = 0;
+        parts[n++] = (struct iovec) { head, 2 };
+        parts[n++] = (struct iovec) { clientHandle, head[1] };
+        parts[n++] = (struct iovec) { &count, 1 };
 
-        // Append each destination handle (with its length)
+        // Each destination id, or each destination handle, preceded by its length
+        uint8_t dhLens[10];
         for (int i = 0; i < numHandles; i++) {
-            uint8_t dhLen = (uint8_t) strlen(destHandles[i]);
-            buf[offset++] = dhLen;
-            memcpy(buf + offset, destHandles[i], dhLen);
-            offset += dhLen;
+            if (byId) {
+                parts[n++] = (struct iovec) { &destIds[i], 4 };
+                continue;
+            }
+            dhLens[i] = (uint8_t) strlen(destHandles[i]);
+            parts[n++] = (struct iovec) { &dhLens[i], 1 };
+            parts[n++] = (struct iovec) { destHandles[i], dhLens[i] };
         }
 
-        // Append the multicast text message including the null terminator
-        int textLen = strlen(text) + 1;
-        memcpy(buf + offset, text, textLen);
-        offset += textLen;
+        // The multicast text message including the null terminator
+        parts[n++] = (struct iovec) { text, strlen(text) + 1 };
 
         // Send the multicast packet to the server
-        sendPDU(socketNum, buf, offset);
+        if (sendPDUv(socketNum, parts, n) < 0)
+            printf("Message too long, not sent\n");
         free(copy);
     }
     else if (cmd == 'L') {
-        /* List request command: %L
-         * Build a simple list request packet.
+        /* List request command: %L [prefix [max]]
+         * Without a prefix, build a simple list request packet.
+         * Packet format:
+         *   [flag=10] [options]
+         * With one, a prefix list request packet.
          * Packet format:
-         *   [flag=10]
+         *   [flag=14] [1-byte prefix length] [prefix] [4-byte max count, network order] [options]
+         * Either way the options ask for the packed (flag=15) response, with the ids.
+         * "%L -p N" starts a paged listing instead (see sendPagedListRequest()).
          */
-        uint8_t buf[1];
-        buf[0] = 10; // List request flag
-        sendPDU(socketNum, buf, 1);
+        uint8_t options = LIST_OPTIONS;
+        char *copy = strdup(input);
+        strtok(copy, " ");                      // Token 1: "%L"
+        char *prefix = strtok(NULL, " ");       // Token 2: prefix (optional)
+        char *maxStr = strtok(NULL, " ");       // Token 3: max count (optional)
+        if (prefix && strcmp(prefix, "-p") == 0) {
+            if (!maxStr || atoi(maxStr) <= 0) {
+                printf("Invalid command format. Usage: %%L -p <page-size>\n");
+            } else {
+                listPageSize = (uint32_t) atoi(maxStr);
+                listTotal = 0;
+                sendPagedListRequest(socketNum, NULL, 0);
+            }
+        } else if (!prefix) {
+            uint8_t buf[2];
+            buf[0] = 10; // List request flag
+            buf[1] = options;
+            struct iovec part = { buf, 2 };
+            sendPDUv(socketNum, &part, 1);
+        } else if (strlen(prefix) > MAX_HANDLE || (maxStr && atoi(maxStr) < 0)) {
+            printf("Invalid command format. Usage: %%L [prefix [max]]\n");
+        } else {
+            uint8_t head[2];
+            head[0] = 14; // Prefix list request flag
+            head[1] = (uint8_t) strlen(prefix);
+            uint32_t max_net = htonl(maxStr ? (uint32_t) atoi(maxStr) : 0);
+            struct iovec parts[4] = { { head, 2 }, { prefix, head[1] }, { &max_net, 4 }, { &options, 1 } };
+            sendPDUv(socketNum, parts, 4);
+        }
+        free(copy);
+    }
+    else if (cmd == 'P') {
+        /* Presence command: %P [off] */
+        const char *arg = input + 2;
+        while (*arg == ' ')
+            arg++;
+        if (strncmp(arg, "off", 3) == 0) {
+            sendPresenceRequest(socketNum, 0);
+            presenceVersion = 0;
+        } else {
+            sendPresenceRequest(socketNum, 1);
+        }
     }
     else if (cmd == 'H') {
         /* Help command: %h
@@ -365,8 +472,14 @@ static void handleCommand(const char *input, int socketNum) {
         printf("       Broadcast <text> to all connected clients.\n");
         printf("  %%C <num> <dest1> <dest2> ... <destN> <text>\n");
         printf("       Send a multicast message to the specified <num> destination handles.\n");
-        printf("  %%L\n");
-        printf("       Request a list of all connected client handles.\n");
+        printf("  %%L [prefix [max]]\n");
+        printf("       Request a list of all connected client handles, or of at most <max> of\n");
+        printf("       those starting with <prefix>.\n");
+        printf("  %%L -p <page-size>\n");
+        printf("       Request the list of all connected client handles <page-size> at a time.\n");
+        printf("  %%P [off]\n");
+        printf("       List the connected client handles, then report every client that joins\n");
+        printf("       or leaves (until %%P off).\n");
         printf("  %%h\n");
         printf("       Display this help message.\n");
         printf("\n");
@@ -377,7 +490,8 @@ static void handleCommand(const char *input, int socketNum) {
         printf("%%M <dest_handle> <text>\n");
         printf("%%B <text>\n");
         printf("%%C <num> <dest1> <dest2> ... <destN> <text>\n");
-        printf("%%L\n");
+        printf("%%L [prefix [max]] | %%L -p <page-size>\n");
+        printf("%%P [off]\n");
         printf("%%h\n");
     }
     // Reprint the prompt after processing the command.
@@ -385,6 +499,94 @@ static void handleCommand(const char *input, int socketNum) {
     fflush(stdout);
 }
 
+/*
+ * sendPagedListRequest:
+ *   Requests the next page (listPageSize handles) of a paged listing, the first one
+ *   for an empty cursor. The cursor is taken as is from the flag=13 packet that ended
+ *   the previous page.
+ *   Packet format:
+ *     [flag=16] [1-byte cursor length] [cursor] [4-byte page size, network order] [options]
+ */
+static void sendPagedListRequest(int socketNum, const uint8_t *cursor, uint8_t cursorLen) {
+    uint8_t head[2];
+    head[0] = 16; // Paged list request flag
+    head[1] = cursorLen;
+    uint32_t size_net = htonl(listPageSize);
+    uint8_t options = LIST_OPTIONS;
+    struct iovec parts[4] = { { head, 2 }, { (void *) cursor, cursorLen }, { &size_net, 4 }, { &options, 1 } };
+    sendPDUv(socketNum, parts, 4);
+    listing = 1;
+}
+
+/*
+ * sendPresenceRequest:
+ *   Subscribes to presence deltas (again, to resync after a gap) or unsubscribes.
+ *   Packet format:
+ *     [flag=18] [1-byte subscribe (1) or unsubscribe (0)] [options]
+ */
+static void sendPresenceRequest(int socketNum, uint8_t subscribe) {
+    uint8_t buf[3];
+    buf[0] = 18; // Presence flag
+    buf[1] = subscribe;
+    buf[2] = LIST_OPTIONS;
+    struct iovec part = { buf, 3 };
+    sendPDUv(socketNum, &part, 1);
+}
+
+/*
+ * findPeerId:
+ *   Returns the link that points at the cache entry for 'handle', or at the
+ *   end of its chain if there is none (FNV-1a picks the chain).
+ */
+static struct peerId **findPeerId(const char *handle) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = handle; *c; c++)
+        hash = (hash ^ (uint8_t) *c) * 16777619u;
+    struct peerId **link = &peerIds[hash % PEER_BUCKETS];
+    while (*link != NULL && strcmp((*link)->handle, handle) != 0)
+        link = &(*link)->next;
+    return link;
+}
+
+/*
+ * rememberPeerId:
+ *   Caches the id of 'handle', replacing any id cached for it before.
+ */
+static void rememberPeerId(const char *handle, uint32_t id) {
+    struct peerId **link = findPeerId(handle);
+    if (*link == NULL) {
+        *link = calloc(1, sizeof(struct peerId));
+        if (*link == NULL) {
+            perror("calloc");
+            exit(-1);
+        }
+        strncpy((*link)->handle, handle, MAX_HANDLE);
+    }
+    (*link)->id = id;
+}
+
+/*
+ * forgetPeerId:
+ *   Drops the cached id of 'handle' (if any).
+ */
+static void forgetPeerId(const char *handle) {
+    struct peerId **link = findPeerId(handle);
+    if (*link != NULL) {
+        struct peerId *gone = *link;
+        *link = gone->next;
+        free(gone);
+    }
+}
+
+/*
+ * lookupPeerId:
+ *   Returns the cached id of 'handle', or 0 if none is known.
+ */
+static uint32_t lookupPeerId(const char *handle) {
+    struct peerId *peer = *findPeerId(handle);
+    return peer ? peer->id : 0;
+}
+
 /*
  * processSocketData:
  *   Handles data received from the server.
@@ -395,8 +597,16 @@ static void handleCommand(const char *input, int socketNum) {
  *     - Broadcast (flag=4): Contains a broadcast message from another client.
  *     - Private message (flag=5): Contains a direct message from another client.
  *     - Multicast (flag=6): Contains a multicast message.
+ *     - Private message and multicast by id (flag=8, flag=9): The same, with destination ids.
+ *     - Id error packet (flag=17): Notifies that a destination id is not (or no longer) registered.
  *     - List response (flag=11): Contains the number of clients and then a series
- *         of packets (flag=12 for each handle) followed by a termination packet (flag=13).
+ *         of packets (flag=12 for each handle, or flag=15 holding many) followed by a
+ *         termination packet (flag=13). Each of them arrives through here on its own,
+ *         and the prompt is held back until the list is complete.
+ *     - Presence snapshot (flag=19): The membership version, followed by a list response.
+ *     - Presence deltas (flag=20 join, flag=21 leave): A client joined or left. If the
+ *         version does not follow the last one, a delta was missed and a new snapshot is
+ *         requested.
  */
 static void processSocketData(int socketNum) {
     uint8_t buf[MAXBUF];             // Buffer to hold the incoming packet
@@ -420,6 +630,28 @@ static void processSocketData(int socketNum) {
         missingHandle[hlen] = '\0';
         printf("\nClient with handle %s does not exist.\n", missingHandle);
     }
+    else if (flag == 17) {
+        /* Id error packet: Format is [flag=17] [4-byte id]
+         * The peer cached under that id has left (its handle may since be registered
+         * again under a new id), so the id is forgotten and the next message goes by handle.
+         */
+        if (len < 5) return;
+        uint32_t id_net;
+        memcpy(&id_net, buf + 1, 4);
+        uint32_t id = ntohl(id_net);
+        char missingHandle[MAX_HANDLE+1] = {0};
+        for (int i = 0; i < PEER_BUCKETS && missingHandle[0] == '\0'; i++)
+            for (struct peerId *peer = peerIds[i]; peer != NULL; peer = peer->next)
+                if (peer->id == id) {
+                    strcpy(missingHandle, peer->handle);
+                    break;
+                }
+        if (missingHandle[0] != '\0') {
+            forgetPeerId(missingHandle);
+            printf("\nClient with handle %s does not exist.\n", missingHandle);
+        } else
+            printf("\nClient with id %u does not exist.\n", id);
+    }
     else if (flag == 4) {
         /* Broadcast message: Format is [flag=4] [1-byte sender handle length]
          * [sender handle] [text message]
@@ -469,34 +701,109 @@ static void processSocketData(int socketNum) {
         char *msg = (char *)(buf + off);
         printf("\n%s: %s\n", sender, msg);
     }
+    else if (flag == 8 || flag == 9) {
+        /* Private message or multicast by id: Format is [flag=8 or 9] [1-byte sender handle length]
+         * [sender handle] [1-byte number of destinations] [4-byte id of each] [text message]
+         */
+        int off = 1;
+        uint8_t shLen = buf[off++];
+        char sender[MAX_HANDLE+1] = {0};
+        memcpy(sender, buf + off, shLen);
+        sender[shLen] = '\0';
+        off += shLen;
+        uint8_t num = buf[off++];
+        off += 4 * num; // Skip the destination ids
+        char *msg = (char *)(buf + off);
+        printf("\n%s: %s\n", sender, msg);
+    }
+    else if (flag == 19) {
+        /* Presence snapshot: Format is [flag=19] [4-byte version], the list follows */
+        if (len < 5) return;
+        uint32_t version_net;
+        memcpy(&version_net, buf + 1, 4);
+        presenceVersion = ntohl(version_net);
+        return;
+    }
+    else if (flag == 20 || flag == 21) {
+        /* Presence delta: Format is [flag=20 or 21] [4-byte version] [1-byte handle length] [handle]
+         * [4-byte id]
+         */
+        if (len < 6 || presenceVersion == 0) return;
+        uint32_t version_net;
+        memcpy(&version_net, buf + 1, 4);
+        uint32_t version = ntohl(version_net);
+        uint8_t hlen = buf[5];
+        if (hlen > MAX_HANDLE || len < 6 + hlen + 4) return;
+        char handle[MAX_HANDLE+1] = {0};
+        memcpy(handle, buf + 6, hlen);
+        handle[hlen] = '\0';
+        uint32_t id_net;
+        memcpy(&id_net, buf + 6 + hlen, 4);
+        if (flag == 20)
+            rememberPeerId(handle, ntohl(id_net));
+        else
+            forgetPeerId(handle);
+        printf("\n%s has %s the chat.\n", handle, flag == 20 ? "joined" : "left");
+        if (version != presenceVersion + 1) {
+            printf("Missed presence updates, refreshing the client list.\n");
+            sendPresenceRequest(socketNum, 1);
+        }
+        presenceVersion = version;
+    }
     else if (flag == 11) {
         /* List response:
          * The first packet (flag=11) contains a 4-byte count of connected clients.
-         * It is followed by 'count' packets (each with flag=12) containing individual handles,
+         * It is followed by 'count' handles, in flag=12 or flag=15 packets,
          * and finally a termination packet with flag=13.
          */
         if (len < 5) return;
         uint32_t count_net;
         memcpy(&count_net, buf + 1, 4); // Extract the 4-byte count (network byte order)
         uint32_t count = ntohl(count_net); // Convert count to host byte order
-        printf("\nNumber of clients: %u\n", count);
-        // Loop to receive each handle (flag=12 packets)
-        for (uint32_t i = 0; i < count; i++) {
-            uint8_t pkt[MAXBUF];
-            int r = recvPDU(socketNum, pkt, MAXBUF);
-            if (r <= 0) break;
-            if (pkt[0] != 12) continue;  // Each handle packet should start with flag 12
-            int off = 1;
-            uint8_t hlen = pkt[off++];
+        if (listPageSize) {
+            if (listTotal == 0)
+                printf("\n");
+            listTotal += count;  // Paged: the total is printed after the last page
+        } else
+            printf("\nNumber of clients: %u\n", count);
+        listing = 1;
+    }
+    else if (flag == 12 || flag == 15) {
+        /* Handles of a list response: Format is [flag=12] [1-byte handle length] [handle] [4-byte id],
+         * or [flag=15] followed by any number of [1-byte handle length] [handle] [4-byte id] entries.
+         */
+        int off = 1;
+        while (off < len) {
+            uint8_t hlen = buf[off++];
+            if (hlen > MAX_HANDLE || off + hlen + 4 > len) break;
             char handle[MAX_HANDLE+1] = {0};
-            memcpy(handle, pkt + off, hlen);
+            memcpy(handle, buf + off, hlen);
             handle[hlen] = '\0';
             printf("%s\n", handle);
+            off += hlen;
+            uint32_t id_net;
+            memcpy(&id_net, buf + off, 4);
+            rememberPeerId(handle, ntohl(id_net));
+            off += 4;
+            if (flag == 12) break;
         }
-        // Finally, read the termination packet with flag=13
-        uint8_t term;
-        recvPDU(socketNum, &term, 1);
     }
+    else if (flag == 13) {
+        /* End of the list response. For a paged listing, it is [flag=13] [1-byte cursor length]
+         * [cursor]: a non-empty cursor means there are more pages, so request the next one.
+         */
+        if (listPageSize && len >= 2 && buf[1] > 0 && len >= 2 + buf[1]) {
+            sendPagedListRequest(socketNum, buf + 2, buf[1]);
+            return;
+        }
+        if (listPageSize) {
+            printf("Number of clients: %u\n", listTotal);
+            listPageSize = 0;
+        }
+        listing = 0;
+    }
+    if (listing)
+        return;
     // Reprint the prompt after processing the incoming data
     printf("$: ");
     fflush(stdout);
@@ -508,6 +815,7 @@ static void processSocketData(int socketNum) {
  *   Sets up a polling mechanism to wait for input from either STDIN (user input)
  *   or the socket (incoming data from the server).
  *
+ *   Both may be reported by the same pollCallMany() wakeup.
  *   When STDIN is ready, processUserInput() is called.
  *   When the socket is ready, processSocketData() is called.
  */
@@ -516,16 +824,20 @@ static void clientControlLoop(int socketNum) {
     addToPollSet(STDIN_FILENO);  // Add standard input (keyboard) to the poll set
     addToPollSet(socketNum);     // Add the server socket to the poll set
 
+    struct pollReady readyList[2];
     while (1) {
-        // Wait indefinitely until one of the monitored file descriptors is ready
-        int ready = pollCall(-1);
-        if (ready == STDIN_FILENO)
-            processUserInput(socketNum);
-        else if (ready == socketNum)
-            processSocketData(socketNum);
-        else {
-            // In the unlikely event that an unexpected descriptor is ready, log it.
-            fprintf(stderr, "Unexpected FD %d\n", ready);
+        // Wait indefinitely until one or both monitored file descriptors are ready
+        int readyCount = pollCallMany(POLL_WAIT_FOREVER, readyList, 2);
+        for (int i = 0; i < readyCount; i++) {
+            int ready = readyList[i].fd;
+            if (ready == STDIN_FILENO)
+                processUserInput(socketNum);
+            else if (ready == socketNum)
+                processSocketData(socketNum);
+            else {
+                // In the unlikely event that an unexpected descriptor is ready, log it.
+                fprintf(stderr, "Unexpected FD %d\n", ready);
+            }
         }
     }
 }
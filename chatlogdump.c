@@ -0,0 +1,133 @@
+/******************************************************************************
+ * chatlogdump.c
+ *
+ * Offline decoder for the server's binary event log (server -e file).
+ *
+ * Usage: chatlogdump [-c] event-log-file
+ *        -c  print CSV (one header line, then one line per record)
+ *            instead of aligned text
+ *
+ * The file must have been written on a machine with the same byte order
+ * (see eventLog.h); a mismatched header is reported and nothing decoded.
+ * A file that ends part way into a record (the server died mid-write) is
+ * decoded up to that record, which is then reported with its byte offset,
+ * and the exit status is 1.
+ *
+ * Author: Robin Simpson
+ * Lab Section: 3pm
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "eventLog.h"
+
+#define RECORDS_PER_READ 1024
+
+static const char *eventName(int type);
+static void printRecord(const struct eventRecord *record, int csv);
+
+int main(int argc, char *argv[]) {
+    int csv = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c")) != -1) {
+        if (opt == 'c') {
+            csv = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-c] event-log-file\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "Usage: %s [-c] event-log-file\n", argv[0]);
+        exit(1);
+    }
+
+    FILE *file = fopen(argv[optind], "rb");
+    if (file == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+
+    /* Header: magic, then the record size (which also catches a byte order mismatch) */
+    char magic[8];
+    uint32_t recordSize;
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, EVENT_MAGIC, 8) != 0 ||
+        fread(&recordSize, sizeof(recordSize), 1, file) != 1) {
+        fprintf(stderr, "%s: not a chat server event log\n", argv[optind]);
+        exit(1);
+    }
+    if (recordSize != sizeof(struct eventRecord)) {
+        fprintf(stderr, "%s: record size %u, expected %zu (different byte order or version)\n",
+                argv[optind], recordSize, sizeof(struct eventRecord));
+        exit(1);
+    }
+
+    if (csv)
+        printf("timestamp_ns,event,socket,client_id,flag,length\n");
+
+    /* Read bytes, not records, so a partial record at the end is seen rather than dropped */
+    static struct eventRecord records[RECORDS_PER_READ];
+    long offset = 8 + sizeof(recordSize);  // file offset of records[0]
+    size_t leftover = 0;                   // bytes of a partial record at the start of records
+    size_t bytes;
+    while ((bytes = fread((char *) records + leftover, 1, sizeof(records) - leftover, file)) > 0) {
+        bytes += leftover;
+        size_t count = bytes / sizeof(struct eventRecord);
+        for (size_t i = 0; i < count; i++)
+            printRecord(&records[i], csv);
+        leftover = bytes % sizeof(struct eventRecord);
+        memmove(records, records + count, leftover);
+        offset += count * sizeof(struct eventRecord);
+    }
+    if (ferror(file)) {
+        perror("fread");
+        exit(1);
+    }
+    fclose(file);
+    if (leftover > 0) {
+        fflush(stdout);
+        fprintf(stderr, "%s: truncated record at byte offset %ld: %zu of %zu bytes\n",
+                argv[optind], offset, leftover, sizeof(struct eventRecord));
+        exit(1);
+    }
+    return 0;
+}
+
+/*
+ * eventName:
+ *   Returns the name of an event type, as printed.
+ */
+static const char *eventName(int type) {
+    switch (type) {
+        case EVENT_ACCEPT:     return "accept";
+        case EVENT_REGISTER:   return "register";
+        case EVENT_RELAY:      return "relay";
+        case EVENT_ERROR:      return "error";
+        case EVENT_DISCONNECT: return "disconnect";
+        default:               return "unknown";
+    }
+}
+
+/*
+ * printRecord:
+ *   Prints one record as a CSV line, or as text with a local date and time.
+ */
+static void printRecord(const struct eventRecord *record, int csv) {
+    if (csv) {
+        printf("%llu,%s,%d,%u,%u,%u\n", (unsigned long long) record->timestamp, eventName(record->type),
+               record->socket, record->clientId, record->flag, record->length);
+        return;
+    }
+
+    time_t seconds = record->timestamp / 1000000000u;
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+    printf("%s.%09llu  %-10s  socket %-5d  id %-10u  flag %-3u  length %u\n", when,
+           (unsigned long long) (record->timestamp % 1000000000u), eventName(record->type),
+           record->socket, record->clientId, record->flag, record->length);
+}
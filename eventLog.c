@@ -0,0 +1,132 @@
+/******************************************************************************
+ * eventLog.c
+ *
+ * Implementation of the binary event log.
+ *
+ * Records are copied into a static buffer of EVENT_BUFFER_RECORDS; the only
+ * system calls are the write() of a full (or aged) buffer. The timestamp
+ * comes from clock_gettime(), which does not enter the kernel on Linux.
+ *
+ * Author: Robin Simpson
+ * Lab Section: 3 pm
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "eventLog.h"
+
+#define EVENT_BUFFER_RECORDS 2730      // ~64 KB of records per write()
+
+int eventLogFd = -1;
+
+static struct eventRecord buffer[EVENT_BUFFER_RECORDS];
+static int buffered = 0;
+static uint64_t oldest = 0;            // timestamp of buffer[0]
+
+static void writeAll(const void *bytes, size_t length);
+
+/*
+ * eventLogOpen:
+ *   Opens (or creates) the log file for appending and writes the file
+ *   header if it is empty. eventLogFlush() is registered to run at exit,
+ *   which the server also reaches when stopped by SIGINT or SIGTERM.
+ */
+void eventLogOpen(const char *path) {
+    eventLogFd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (eventLogFd < 0) {
+        perror("open event log");
+        exit(-1);
+    }
+    if (lseek(eventLogFd, 0, SEEK_END) == 0) {
+        uint32_t recordSize = sizeof(struct eventRecord);
+        writeAll(EVENT_MAGIC, 8);
+        writeAll(&recordSize, sizeof(recordSize));
+    }
+    atexit(eventLogFlush);
+}
+
+/*
+ * eventLogAppend:
+ *   Appends one record stamped with the current time, writing the buffer
+ *   out first if it is full. Use eventLogRecord(), which skips the call
+ *   when no log is open.
+ */
+void eventLogAppend(int type, int socket, uint32_t clientId, int flag, int length) {
+    struct timespec now;
+
+    if (buffered == EVENT_BUFFER_RECORDS)
+        eventLogFlush();
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    struct eventRecord *record = &buffer[buffered++];
+    record->timestamp = (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+    if (buffered == 1)
+        oldest = record->timestamp;
+    record->type = type;
+    record->flag = flag;
+    record->reserved = 0;
+    record->socket = socket;
+    record->clientId = clientId;
+    record->length = length;
+}
+
+/*
+ * eventLogPending:
+ *   Returns 1 if records are waiting to be written, else 0.
+ */
+int eventLogPending() {
+    return buffered > 0;
+}
+
+/*
+ * eventLogTick:
+ *   Writes the buffered records out if the oldest has waited EVENT_FLUSH_MS.
+ */
+void eventLogTick() {
+    struct timespec now;
+
+    if (buffered == 0)
+        return;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if ((uint64_t) now.tv_sec * 1000000000u + now.tv_nsec - oldest >= EVENT_FLUSH_MS * 1000000ull)
+        eventLogFlush();
+}
+
+/*
+ * eventLogFlush:
+ *   Writes every buffered record to the file.
+ */
+void eventLogFlush() {
+    if (eventLogFd < 0 || buffered == 0)
+        return;
+    writeAll(buffer, buffered * sizeof(struct eventRecord));
+    buffered = 0;
+}
+
+/*
+ * writeAll:
+ *   Writes the whole buffer, retrying short writes. A failed write is
+ *   reported and the log closed; the server carries on without it.
+ */
+static void writeAll(const void *bytes, size_t length) {
+    const char *next = bytes;
+
+    while (length > 0) {
+        ssize_t written = write(eventLogFd, next, length);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write event log");
+            close(eventLogFd);
+            eventLogFd = -1;
+            return;
+        }
+        next += written;
+        length -= written;
+    }
+}
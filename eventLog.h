@@ -0,0 +1,66 @@
+/******************************************************************************
+ * eventLog.h
+ *
+ * Binary event log of the server (-e file), decoded offline by chatlogdump.
+ *
+ * Every accept, registration, relayed message, error packet and disconnect
+ * is recorded as one fixed-size record, with nothing formatted at run time.
+ * Records are appended to a buffer and written out in large blocks: when
+ * the buffer fills up, when the main loop's eventLogTick() finds the oldest
+ * has waited EVENT_FLUSH_MS, and at exit (the server stops on SIGINT and
+ * SIGTERM by returning from main(), so that includes a normal shutdown).
+ *
+ * File layout: the 8-byte EVENT_MAGIC and a 4-byte record size (both
+ * written only when the file is empty, so runs append to one file), then
+ * records back to back, all in the byte order of the machine that wrote
+ * them.
+ *
+ * Functions:
+ *    eventLogOpen(path) – starts recording to 'path' (appending if it exists).
+ *    eventLogRecord(type, socket, id, flag, length) – records one event (if a log is open).
+ *    eventLogPending() – returns whether records are waiting to be written.
+ *    eventLogTick() – writes the waiting records once the oldest is EVENT_FLUSH_MS old.
+ *    eventLogFlush() – writes the waiting records.
+ *
+ * Author: Robin Simpson
+ * Lab Section: 3 pm
+ *****************************************************************************/
+
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include <stdint.h>
+
+#define EVENT_MAGIC     "CHATEVT1"
+#define EVENT_FLUSH_MS  1000     // longest a record waits in the buffer while the server is idle
+
+/* Event types */
+#define EVENT_ACCEPT      1      // connection accepted
+#define EVENT_REGISTER    2      // handle registered (clientId is the id it was given)
+#define EVENT_RELAY       3      // broadcast, message or multicast relayed (flag, packet length)
+#define EVENT_ERROR       4      // error packet sent back (flag=7 handle or flag=17 id not found)
+#define EVENT_DISCONNECT  5      // connection closed
+
+struct eventRecord {
+    uint64_t timestamp;          // nanoseconds since the epoch
+    uint8_t type;                // EVENT_*
+    uint8_t flag;                // packet flag, 0 if not about a packet
+    uint16_t reserved;
+    int32_t socket;
+    uint32_t clientId;           // client's id, 0 if not registered
+    uint32_t length;             // packet payload length, 0 if not about a packet
+};
+
+extern int eventLogFd;           // -1 while no log is open
+
+void eventLogOpen(const char *path);
+void eventLogAppend(int type, int socket, uint32_t clientId, int flag, int length);
+int eventLogPending();
+void eventLogTick();
+void eventLogFlush();
+
+/* Records an event, costing only a test when no event log is open. */
+#define eventLogRecord(type, socket, clientId, flag, length) \
+    do { if (eventLogFd >= 0) eventLogAppend((type), (socket), (clientId), (flag), (length)); } while (0)
+
+#endif
@@ -3,8 +3,14 @@
  *
  * Implementation of the handle table API.
  *
- * Uses a simple linked list to store entries.
- * Yes I know, we could use a map or multimap but alas what can you do.
+ * Entries live in an array indexed by socket descriptor (descriptors are
+ * small dense integers). The sockets of the registered clients are packed
+ * into one array (swap-removed, so it stays packed) for iteration, and the
+ * handle strings live in a pool of their own. Every registration is given a 32-bit id that resolves to its
+ * entry with one array access; an open-addressing hash index (handle -> id)
+ * serves handle lookups, so nothing walks the table except a full iteration.
+ * A sorted array of the handle pointers answers ordered and prefix queries
+ * with a binary search; a parallel array holds the ids in the same order.
  *
  * Author: Robin Simpson
  * Lab Section: 3 pm
@@ -13,101 +19,287 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "safeUtil.h"
 #include "handleTable.h"
 
-/* 
- * 'head' is a static pointer to the first element in the linked list that 
- * stores all client entries. Since it is declared static at file scope, 
- * it is accessible only within this file.
+/*
+ * 'connections' holds the record of every open socket at its descriptor
+ * number (NULL where no client is connected); it grows as higher
+ * descriptors show up.
+ */
+static struct ClientEntry **connections = NULL;
+static int connectionsSize = 0;
+
+/*
+ * Records and handle strings come from pools, so connect/disconnect churn
+ * recycles the same (contiguous) memory instead of going through malloc()
+ * and free().
+ */
+#define ENTRIES_PER_CHUNK 256
+#define HANDLE_SIZE 101       // longest handle (100) plus the null terminator
+
+static struct sPool entryPool;
+static struct sPool handlePool;
+
+/*
+ * The sockets of the registered clients, positions 0 .. handleCount-1. A
+ * fan-out only touches this array: a linear scan over 4 bytes per client.
+ * Each entry records its position ('member'), so removal moves the last
+ * client into the hole instead of shifting the rest.
+ */
+static int *memberSockets = NULL;
+static unsigned int memberCapacity = 0;
+
+/*
+ * The same handles again, in strcmp() order. Every handle sharing a prefix
+ * sits in one run starting where the prefix itself would be inserted, so a
+ * prefix query is two binary searches and reads nothing outside the run.
+ * Joins and leaves shift the tail of the array (pointers only, one memmove).
+ */
+static char **sortedHandles = NULL;
+static uint32_t *sortedIds = NULL;     // the id of each sorted handle, at the same position
+
+static unsigned int lowerBound(const char *handle);
+
+/*
+ * Live number of registered entries, and a version bumped on every join and
+ * leave so callers can tell whether anything they derived from the table is
+ * still current.
+ */
+static unsigned int handleCount = 0;
+static unsigned int handleVersion = 0;
+
+/*
+ * Client ids. The low ID_SLOT_BITS bits pick a slot in idEntries, the high
+ * bits hold that slot's generation, which changes every time the slot is
+ * freed, so a stale id of a client that has left never resolves to whoever
+ * reuses the slot. Generations start at 1, so 0 is never a valid id.
+ */
+#define ID_SLOT_BITS 20
+#define ID_SLOT_MASK ((1u << ID_SLOT_BITS) - 1)
+#define ID_MAX_SLOTS (1u << ID_SLOT_BITS)
+#define ID_MAX_GENERATION ((1u << (32 - ID_SLOT_BITS)) - 1)
+
+static struct ClientEntry **idEntries = NULL;  // slot -> registered entry, NULL if free
+static uint32_t *idGenerations = NULL;         // slot -> current generation
+static unsigned int *idFreeSlots = NULL;       // stack of freed slots, reused first
+static unsigned int idFreeCount = 0;
+static unsigned int idSlotsUsed = 0;           // slots handed out at least once
+static unsigned int idCapacity = 0;
+
+static uint32_t allocId(struct ClientEntry *entry);
+static void freeId(uint32_t id);
+
+/*
+ * The hash index: a power-of-two array of ids (0 = free slot),
+ * FNV-1a hashed, linear probing. It is kept at most half full so probe runs
+ * stay short, and deletions shift later entries back instead of leaving
+ * tombstones, so a lookup can stop at the first free slot.
  */
-static struct ClientEntry *head = NULL;
+#define INDEX_MIN_SIZE 64
+
+static uint32_t *handleIndex = NULL;
+static unsigned int indexSize = 0;    // number of slots
+static unsigned int indexUsed = 0;    // slots holding an entry
+
+static unsigned int hashHandle(const char *handle);
+static unsigned int findSlot(const char *handle);
+static void indexInsert(struct ClientEntry *entry);
+static void indexRemove(const char *handle);
+static void growIndex();
 
 /*
  * initHandleTable:
- *   Initializes the handle table by setting the head of the list to NULL.
+ *   Initializes the handle table with no members, empty pools and an empty
+ *   hash index.
  *   This function should be called at server startup to ensure that the 
  *   handle table is empty.
  */
 void initHandleTable() {
-    head = NULL;
+    handleCount = 0;
+    handleVersion++;
+    free(connections);
+    connections = NULL;
+    connectionsSize = 0;
+    sPoolInit(&entryPool, sizeof(struct ClientEntry), ENTRIES_PER_CHUNK);
+    sPoolInit(&handlePool, HANDLE_SIZE, ENTRIES_PER_CHUNK);
+    free(handleIndex);
+    handleIndex = calloc(INDEX_MIN_SIZE, sizeof(uint32_t));
+    if (!handleIndex) {
+        perror("calloc");
+        exit(1);
+    }
+    indexSize = INDEX_MIN_SIZE;
+    indexUsed = 0;
+}
+
+/*
+ * addConnection:
+ *   Creates the zeroed record for a newly accepted client on 'socket'.
+ *
+ * Returns:
+ *   The new record. The client has no handle until addHandle() is called.
+ *
+ * Operation:
+ *   - Grows the socket-indexed array (new slots NULL) if the descriptor is beyond it.
+ *   - Takes a zeroed record from the pool and stores it at connections[socket].
+ */
+struct ClientEntry *addConnection(int socket) {
+    if (socket >= connectionsSize) {
+        int newSize = socket + 64;
+        struct ClientEntry **grown = realloc(connections, newSize * sizeof(struct ClientEntry *));
+        if (!grown) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(grown + connectionsSize, 0, (newSize - connectionsSize) * sizeof(struct ClientEntry *));
+        connections = grown;
+        connectionsSize = newSize;
+    }
+
+    struct ClientEntry *entry = sPoolAlloc(&entryPool);
+    entry->socket = socket;
+    connections[socket] = entry;
+    return entry;
+}
+
+/*
+ * lookupConnection:
+ *   Returns the record of the client on 'socket', or NULL if no client is
+ *   connected there. A single array access.
+ */
+struct ClientEntry *lookupConnection(int socket) {
+    if (socket < 0 || socket >= connectionsSize)
+        return NULL;
+    return connections[socket];
+}
+
+/*
+ * getConnectionTableSize:
+ *   Returns one more than the highest socket a record can be stored at, so
+ *   lookupConnection() over 0 .. size-1 visits every open connection.
+ */
+int getConnectionTableSize() {
+    return connectionsSize;
+}
+
+/*
+ * removeConnection:
+ *   Unregisters the client's handle (if any) and returns its record to the pool. The
+ *   caller releases whatever the record's connection state holds first.
+ */
+void removeConnection(int socket) {
+    struct ClientEntry *entry = lookupConnection(socket);
+
+    if (!entry)
+        return;
+    removeHandleBySocket(socket);
+    connections[socket] = NULL;
+    sPoolFree(&entryPool, entry);
 }
 
 /*
  * addHandle:
- *   Adds a new client entry to the handle table.
+ *   Registers a handle for the client on 'socket'.
  *
  * Parameters:
  *   - handle: The string representing the client's handle (username).
  *   - socket: The socket descriptor associated with the client.
  *
  * Returns:
- *   0 on success.
+ *   The client's new id (never 0), or 0 if all ids are in use.
  *
  * Operation:
- *   - Allocates memory for a new ClientEntry structure.
- *   - Copies the provided handle into the structure (ensuring null termination).
- *   - Sets the socket field.
- *   - Inserts the new entry at the beginning of the linked list.
- */
-int addHandle(const char *handle, int socket) {
-    /* Allocate memory for a new client entry */
-    struct ClientEntry *newEntry = malloc(sizeof(struct ClientEntry));
-    if (!newEntry) {
-        perror("malloc");
-        exit(1);
-    }
-    /* Copy the provided handle into the new entry.
+ *   - Uses the connection's record (creating one if the socket has none),
+ *     dropping any handle it registered before.
+ *   - Gives it an id.
+ *   - Copies the provided handle into a string from the handle pool (ensuring null termination).
+ *   - Appends its socket to the member array (growing the arrays if full), inserts
+ *     its handle into the sorted array and its id into the hash index.
+ */
+uint32_t addHandle(const char *handle, int socket) {
+    struct ClientEntry *newEntry = lookupConnection(socket);
+    if (!newEntry)
+        newEntry = addConnection(socket);
+    else
+        removeHandleBySocket(socket);
+
+    newEntry->id = allocId(newEntry);
+    if (newEntry->id == 0)
+        return 0;
+
+    /* Copy the provided handle into a pooled string.
      * Use strncpy to avoid buffer overflow, limiting copy to 100 characters.
      * Then, explicitly set the 101st character to '\0' to ensure proper null-termination.
      */
-    strncpy(newEntry->handle, handle, 100);
-    newEntry->handle[100] = '\0';
-    
-    /* Set the socket descriptor for the client */
-    newEntry->socket = socket;
-    
-    /* Insert the new entry at the beginning of the linked list */
-    newEntry->next = head;
-    head = newEntry;
+    newEntry->handle = sPoolAlloc(&handlePool);
+    strncpy(newEntry->handle, handle, HANDLE_SIZE - 1);
+    newEntry->handle[HANDLE_SIZE - 1] = '\0';
+
+    /* Append the client to the member array */
+    if (handleCount == memberCapacity) {
+        memberCapacity = memberCapacity ? memberCapacity * 2 : 64;
+        memberSockets = srealloc(memberSockets, memberCapacity * sizeof(int));
+        sortedHandles = srealloc(sortedHandles, memberCapacity * sizeof(char *));
+        sortedIds = srealloc(sortedIds, memberCapacity * sizeof(uint32_t));
+    }
+    newEntry->member = handleCount;
+    memberSockets[handleCount] = socket;
+
+    /* Insert it in order */
+    unsigned int pos = lowerBound(newEntry->handle);
+    memmove(sortedHandles + pos + 1, sortedHandles + pos, (handleCount - pos) * sizeof(char *));
+    sortedHandles[pos] = newEntry->handle;
+    memmove(sortedIds + pos + 1, sortedIds + pos, (handleCount - pos) * sizeof(uint32_t));
+    sortedIds[pos] = newEntry->id;
+
+    /* Index it by handle */
+    indexInsert(newEntry);
+    handleCount++;
+    handleVersion++;
     
-    return 0;
+    return newEntry->id;
 }
 
 /*
  * removeHandleBySocket:
- *   Removes a client entry from the handle table based on its socket descriptor.
+ *   Unregisters the handle of the client on 'socket'. The connection's
+ *   record itself stays until removeConnection().
  *
  * Parameters:
- *   - socket: The socket descriptor of the client to be removed.
+ *   - socket: The socket descriptor of the client.
  *
  * Returns:
- *   0 if an entry is successfully removed, or -1 if no matching entry is found.
+ *   0 if a handle was removed, or -1 if the client has none registered.
  *
  * Operation:
- *   - Traverses the linked list looking for an entry whose socket matches the given socket.
- *   - Updates the pointers to remove the entry from the list and frees its memory.
+ *   - Finds the record by socket, moves the last member into its position
+ *     in the member array, drops it from the sorted array and the hash index,
+ *     frees its id and returns its handle string to the pool. No list walk.
  */
 int removeHandleBySocket(int socket) {
-    struct ClientEntry *curr = head, *prev = NULL;
-    
-    /* Traverse the linked list */
-    while (curr) {
-        if (curr->socket == socket) {
-            /* Found the matching entry. Adjust pointers accordingly. */
-            if (prev)
-                prev->next = curr->next;
-            else
-                head = curr->next;
-                
-            /* Free the memory allocated for the removed entry */
-            free(curr);
-            return 0;
-        }
-        prev = curr;
-        curr = curr->next;
-    }
-    /* If we reach here, no matching entry was found */
-    return -1;
+    struct ClientEntry *curr = lookupConnection(socket);
+
+    if (!curr || !curr->handle)
+        return -1;
+
+    /* Fill the hole with the last member (a no-op if it is the last one) */
+    unsigned int last = handleCount - 1;
+    memberSockets[curr->member] = memberSockets[last];
+    connections[memberSockets[last]]->member = curr->member;
+
+    unsigned int pos = lowerBound(curr->handle);
+    memmove(sortedHandles + pos, sortedHandles + pos + 1, (last - pos) * sizeof(char *));
+    memmove(sortedIds + pos, sortedIds + pos + 1, (last - pos) * sizeof(uint32_t));
+
+    indexRemove(curr->handle);
+    freeId(curr->id);
+    sPoolFree(&handlePool, curr->handle);
+    curr->handle = NULL;
+    curr->id = 0;
+    handleCount--;
+    handleVersion++;
+    return 0;
 }
 
 /*
@@ -120,23 +312,41 @@ int removeHandleBySocket(int socket) {
  *
  * Returns:
  *   The socket descriptor if found, or -1 if no matching entry exists.
+ *
+ * Operation:
+ *   - One hash index probe (O(1) expected) for the id, which leads to the entry.
  */
 int lookupSocketByHandle(const char *handle) {
-    struct ClientEntry *curr = head;
-    
-    /* Traverse the linked list looking for the matching handle */
-    while (curr) {
-        if (strcmp(curr->handle, handle) == 0)
-            return curr->socket;
-        curr = curr->next;
-    }
+    struct ClientEntry *entry = lookupById(lookupIdByHandle(handle));
+
     /* Return -1 if no entry with the given handle is found */
-    return -1;
+    return entry ? entry->socket : -1;
+}
+
+/*
+ * lookupIdByHandle:
+ *   Returns the id registered for 'handle', or 0 if there is none.
+ */
+uint32_t lookupIdByHandle(const char *handle) {
+    return handleIndex[findSlot(handle)];
+}
+
+/*
+ * lookupById:
+ *   Returns the entry of the client registered under 'id', or NULL if the
+ *   id is 0, malformed or stale (that client has left). One array access.
+ */
+struct ClientEntry *lookupById(uint32_t id) {
+    unsigned int slot = id & ID_SLOT_MASK;
+
+    if (id == 0 || slot >= idSlotsUsed || idGenerations[slot] != id >> ID_SLOT_BITS)
+        return NULL;
+    return idEntries[slot];
 }
 
 /*
  * lookupHandleBySocket:
- *   Searches for a client entry by its socket descriptor and returns the
+ *   Looks up a client entry by its socket descriptor (one array access) and returns the
  *   corresponding handle (username).
  *
  * Parameters:
@@ -146,52 +356,274 @@ int lookupSocketByHandle(const char *handle) {
  *   A pointer to the handle string if found, or NULL if not found.
  *
  * Note:
- *   The returned pointer refers to the handle stored within the linked list.
+ *   The returned pointer refers to the handle stored within the client's record.
  */
 char *lookupHandleBySocket(int socket) {
-    struct ClientEntry *curr = head;
-    
-    /* Traverse the linked list */
-    while (curr) {
-        if (curr->socket == socket)
-            return curr->handle;
-        curr = curr->next;
-    }
-    return NULL;
+    struct ClientEntry *curr = lookupConnection(socket);
+
+    if (!curr)
+        return NULL;
+    return curr->handle;
 }
 
 /*
  * getHandleCount:
- *   Counts the total number of client entries in the handle table.
+ *   Returns the total number of registered client entries in the handle table.
  *
  * Returns:
  *   The count of client entries as an unsigned integer.
  *
  * Operation:
- *   - Traverses the linked list and increments a counter for each entry.
+ *   - Reads the live count kept by addHandle() and removeHandleBySocket().
  */
 unsigned int getHandleCount() {
-    unsigned int count = 0;
-    struct ClientEntry *curr = head;
-    
-    /* Loop through the list, counting each entry */
-    while (curr) {
-        count++;
-        curr = curr->next;
-    }
-    return count;
+    return handleCount;
 }
 
 /*
- * getHandleTableHead:
- *   Returns the head pointer of the handle table.
+ * getHandleTableVersion:
+ *   Returns the membership version, which changes whenever a handle is
+ *   added or removed (and only then).
+ */
+unsigned int getHandleTableVersion() {
+    return handleVersion;
+}
+
+/*
+ * getHandleTableSockets:
+ *   Returns the sockets of all registered clients, packed into
+ *   getHandleCount() consecutive ints (in no particular order).
  *
- * Returns:
- *   A pointer to the first ClientEntry in the linked list.
+ * Note:
+ *   The array is valid until the next addHandle() or removal.
+ */
+const int *getHandleTableSockets() {
+    return memberSockets;
+}
+
+/*
+ * getSortedHandles:
+ *   Returns the handles of all registered clients, getHandleCount() of them,
+ *   in strcmp() order.
  *
  * Note:
- *   This function allows external modules (like the server) to traverse the handle table.
+ *   The array is valid until the next addHandle() or removal.
+ */
+char *const *getSortedHandles() {
+    return sortedHandles;
+}
+
+/*
+ * getSortedIds:
+ *   Returns the ids of all registered clients, in the same order as
+ *   getSortedHandles().
+ *
+ * Note:
+ *   The array is valid until the next addHandle() or removal.
+ */
+const uint32_t *getSortedIds() {
+    return sortedIds;
+}
+
+/*
+ * findHandlesByPrefix:
+ *   Finds the registered handles that start with 'prefix' (all of them for
+ *   an empty prefix).
+ *
+ * Returns:
+ *   The number of matches; *first is set to the position of the first one
+ *   in getSortedHandles(), the rest follow it in order.
+ *
+ * Operation:
+ *   - Binary search for where the prefix would be inserted: no smaller handle
+ *     can start with it, and every one that does follows in a single run.
+ *   - Binary search within the rest for the end of that run.
+ */
+unsigned int findHandlesByPrefix(const char *prefix, unsigned int *first) {
+    size_t prefixLen = strlen(prefix);
+    unsigned int low = lowerBound(prefix);
+    unsigned int high = handleCount;
+
+    *first = low;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (strncmp(sortedHandles[mid], prefix, prefixLen) == 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low - *first;
+}
+
+/*
+ * findHandlesAfter:
+ *   Returns the position in getSortedHandles() of the first registered
+ *   handle that sorts after 'handle' (getHandleCount() if there is none).
+ *   'handle' does not have to be registered, so a caller paging through
+ *   the sorted handles can resume after the last one it saw even if that
+ *   client has left since.
  */
-struct ClientEntry *getHandleTableHead() {
-    return head;
+unsigned int findHandlesAfter(const char *handle) {
+    unsigned int low = 0;
+    unsigned int high = handleCount;
+
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (strcmp(sortedHandles[mid], handle) <= 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/*
+ * lowerBound:
+ *   Returns the position of the first sorted handle not less than 'handle'
+ *   (handleCount if there is none).
+ */
+static unsigned int lowerBound(const char *handle) {
+    unsigned int low = 0;
+    unsigned int high = handleCount;
+
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (strcmp(sortedHandles[mid], handle) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/*
+ * hashHandle:
+ *   32-bit FNV-1a hash of the handle string.
+ */
+static unsigned int hashHandle(const char *handle) {
+    unsigned int hash = 2166136261u;
+
+    while (*handle) {
+        hash ^= (unsigned char) *handle++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * findSlot:
+ *   Returns the index slot holding 'handle', or the free slot that ends its
+ *   probe run (where it would be inserted) if it is not in the table.
+ */
+static unsigned int findSlot(const char *handle) {
+    unsigned int mask = indexSize - 1;
+    unsigned int slot = hashHandle(handle) & mask;
+
+    while (handleIndex[slot] && strcmp(idEntries[handleIndex[slot] & ID_SLOT_MASK]->handle, handle) != 0)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+/*
+ * indexInsert:
+ *   Adds an entry's id to the index, doubling it first if that would make it more
+ *   than half full.
+ */
+static void indexInsert(struct ClientEntry *entry) {
+    if (2 * (indexUsed + 1) > indexSize)
+        growIndex();
+
+    unsigned int slot = findSlot(entry->handle);
+    if (!handleIndex[slot])
+        indexUsed++;
+    handleIndex[slot] = entry->id;
+}
+
+/*
+ * indexRemove:
+ *   Clears the handle's slot, then walks the rest of its probe run moving back
+ *   every entry whose home slot lies at or before the hole, so no entry ends
+ *   up behind a free slot its lookups would stop at.
+ */
+static void indexRemove(const char *handle) {
+    unsigned int mask = indexSize - 1;
+    unsigned int hole = findSlot(handle);
+    unsigned int slot = hole;
+
+    if (!handleIndex[hole])
+        return;
+    handleIndex[hole] = 0;
+    indexUsed--;
+
+    while (handleIndex[slot = (slot + 1) & mask]) {
+        unsigned int home = hashHandle(idEntries[handleIndex[slot] & ID_SLOT_MASK]->handle) & mask;
+        /* Distance from home to the hole vs. home to the current slot (cyclic) */
+        if (((hole - home) & mask) < ((slot - home) & mask)) {
+            handleIndex[hole] = handleIndex[slot];
+            handleIndex[slot] = 0;
+            hole = slot;
+        }
+    }
+}
+
+/*
+ * growIndex:
+ *   Doubles the index and re-inserts every registered entry.
+ */
+static void growIndex() {
+    free(handleIndex);
+    indexSize *= 2;
+    handleIndex = calloc(indexSize, sizeof(uint32_t));
+    if (!handleIndex) {
+        perror("calloc");
+        exit(1);
+    }
+
+    indexUsed = 0;
+    for (unsigned int i = 0; i < handleCount; i++) {
+        struct ClientEntry *curr = connections[memberSockets[i]];
+        handleIndex[findSlot(curr->handle)] = curr->id;
+        indexUsed++;
+    }
+}
+
+/*
+ * allocId:
+ *   Hands 'entry' a free slot (most recently freed first, else a new one,
+ *   growing the slot arrays as needed) and returns the id for it, or 0 if
+ *   every slot is taken.
+ */
+static uint32_t allocId(struct ClientEntry *entry) {
+    unsigned int slot;
+
+    if (idFreeCount > 0) {
+        slot = idFreeSlots[--idFreeCount];
+    } else if (idSlotsUsed < ID_MAX_SLOTS) {
+        if (idSlotsUsed == idCapacity) {
+            idCapacity = idCapacity ? idCapacity * 2 : 64;
+            idEntries = srealloc(idEntries, idCapacity * sizeof(struct ClientEntry *));
+            idGenerations = srealloc(idGenerations, idCapacity * sizeof(uint32_t));
+            idFreeSlots = srealloc(idFreeSlots, idCapacity * sizeof(unsigned int));
+        }
+        slot = idSlotsUsed++;
+        idGenerations[slot] = 1;
+    } else {
+        return 0;
+    }
+
+    idEntries[slot] = entry;
+    return (idGenerations[slot] << ID_SLOT_BITS) | slot;
+}
+
+/*
+ * freeId:
+ *   Releases the id's slot and moves it to its next generation (wrapping
+ *   back to 1), which makes the old id stale.
+ */
+static void freeId(uint32_t id) {
+    unsigned int slot = id & ID_SLOT_MASK;
+
+    idEntries[slot] = NULL;
+    idGenerations[slot] = idGenerations[slot] % ID_MAX_GENERATION + 1;
+    idFreeSlots[idFreeCount++] = slot;
 }
@@ -3,17 +3,32 @@
  *
  * API for the server’s handle table.
  *
- * Defines a dynamic data structure (here implemented as a linked list)
- * that maps a client’s handle (a string) to its socket descriptor.
+ * Holds one record per open client connection in an array indexed by socket
+ * descriptor, so everything keyed by socket is a direct array access. The
+ * sockets of the registered clients are also packed into one array (for
+ * iteration), and the clients are indexed by a hash table on the handle,
+ * which maps a client’s handle (a string) to its record, and by a sorted
+ * array for ordered and prefix queries.
  *
  * Functions:
  *    initHandleTable() – must be called at server startup.
- *    addHandle(handle, socket) – adds a client entry.
- *    removeHandleBySocket(socket) – removes an entry by socket.
+ *    addConnection(socket) – creates the record for a newly accepted client.
+ *    lookupConnection(socket) – returns the record for a socket (or NULL).
+ *    getConnectionTableSize() – returns the bound for iterating over the open connections.
+ *    removeConnection(socket) – unregisters and frees the record for a socket.
+ *    addHandle(handle, socket) – registers a handle for a connection, returns its id.
+ *    removeHandleBySocket(socket) – unregisters the handle of a connection.
  *    lookupSocketByHandle(handle) – returns the socket for a given handle (or -1 if not found).
  *    lookupHandleBySocket(socket) – returns the registered handle for a given socket (or NULL).
+ *    lookupIdByHandle(handle) – returns the id registered for a handle (or 0).
+ *    lookupById(id) – returns the entry registered under an id (or NULL).
  *    getHandleCount() – returns the number of registered handles.
- *    getHandleTableHead() – returns a pointer to the head of the table (for iteration).
+ *    getHandleTableVersion() – returns a version that changes on every join or leave.
+ *    getHandleTableSockets() – returns the sockets of all registered clients (for iteration).
+ *    getSortedHandles() – returns the registered handles in sorted order.
+ *    getSortedIds() – returns their ids, in the same order.
+ *    findHandlesByPrefix(prefix, &first) – returns how many sorted handles, from first on, start with prefix.
+ *    findHandlesAfter(handle) – returns the sorted position of the first handle after the given one.
  *
  * Author: Robin Simpson
  * Lab Section: 3 pm
@@ -22,18 +37,47 @@
 #ifndef HANDLETABLE_H
 #define HANDLETABLE_H
 
+#include <netinet/in.h>    // INET6_ADDRSTRLEN
+#include "pdu.h"
+
 struct ClientEntry {
-    char handle[101];
+    char *handle;                // registered handle (pooled string), NULL until the client registers
     int socket;
-    struct ClientEntry *next;
+    uint32_t id;                 // id assigned at registration, 0 until then
+    unsigned int member;         // position in the member arrays while registered
+
+    /* Connection state, kept by the server */
+    struct pduDecoder decoder;   // receive state (buffered bytes, partial frame)
+    struct pduQueue outbound;    // frames waiting for the socket to take them
+    int backlogged;              // on the backlog for the next pass of the main loop
+    unsigned int servicedPass;   // pass of the main loop it last had its turn in
+    int writeInterest;           // POLLOUT is being watched because 'outbound' is not empty
+    int failed;                  // send failed or queue overflowed, closed at the next safe point
+    int fanoutPending;           // has a send in the server's current fan-out batch
+    int subscribed;              // receives presence deltas (joins and leaves)
+    int subscriberIndex;         // position in the server's subscriber list while subscribed
+    int presenceIds;             // wants the client's id with each delta (LIST_IDS)
+    char peerIP[INET6_ADDRSTRLEN];  // client's address as accept() reported it, for log messages
+    int peerPort;
 };
 
 void initHandleTable();
-int addHandle(const char *handle, int socket);
+struct ClientEntry *addConnection(int socket);
+struct ClientEntry *lookupConnection(int socket); // Returns the record or NULL if the socket is not open.
+int getConnectionTableSize();                   // Sockets below this may have a record.
+void removeConnection(int socket);
+uint32_t addHandle(const char *handle, int socket); // Returns the new id, or 0 if none is left.
 int removeHandleBySocket(int socket);
 int lookupSocketByHandle(const char *handle); // Returns socket or -1 if not found.
 char *lookupHandleBySocket(int socket);         // Returns pointer to the handle string or NULL.
+uint32_t lookupIdByHandle(const char *handle);  // Returns the id or 0 if not found.
+struct ClientEntry *lookupById(uint32_t id);    // Returns the entry or NULL if the id is not (or no longer) registered.
 unsigned int getHandleCount();
-struct ClientEntry *getHandleTableHead();
+unsigned int getHandleTableVersion();
+const int *getHandleTableSockets();
+char *const *getSortedHandles();
+const uint32_t *getSortedIds();
+unsigned int findHandlesByPrefix(const char *prefix, unsigned int *first); // Returns the match count.
+unsigned int findHandlesAfter(const char *handle); // Returns a position in the sorted handles.
 
 #endif
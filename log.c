@@ -0,0 +1,232 @@
+/******************************************************************************
+ * log.c
+ *
+ * Implementation of the asynchronous logger.
+ *
+ * The ring is a power-of-two array of fixed-size records with two free-running
+ * counters: 'ringHead' is advanced only by the logging thread, 'ringTail'
+ * only by the writer thread, so neither needs a lock. A record is published
+ * by the release store of ringHead after its text is in place, and handed
+ * back by the release store of ringTail after the writer has copied it out.
+ *
+ * When the ring is empty the writer sleeps on a condition variable. The
+ * logging thread takes the lock only to wake it: after publishing a record
+ * it checks 'writerSleeping', which the writer sets before its last look at
+ * ringHead (both sequentially consistent, so one of them sees the other),
+ * so a record is never left waiting and a busy writer costs no lock at all.
+ *
+ * The arguments are rendered by the caller, since strings it passes (handles,
+ * message text) may be gone by the time the writer gets to them. Everything
+ * else - the level tag, batching, and the write() itself - happens on the
+ * writer thread.
+ *
+ * Author: Robin Simpson
+ * Lab Section: 3 pm
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include "log.h"
+
+#define LOG_RING_SLOTS 1024        // records the ring holds (a power of two)
+#define LOG_TEXT_SIZE  240         // longest message kept (longer ones are truncated)
+#define LOG_BATCH_SIZE (64 * 1024) // bytes formatted per write()
+
+struct logRecord {
+    int level;
+    int length;                    // bytes of text in use
+    char text[LOG_TEXT_SIZE];
+};
+
+int logLevel = LOG_LEVEL_INFO;
+
+static struct logRecord ring[LOG_RING_SLOTS];
+static unsigned int ringHead = 0;  // next record to fill (logging thread)
+static unsigned int ringTail = 0;  // next record to write (writer thread)
+static unsigned int dropped = 0;   // messages lost to a full ring (logging thread)
+static int stopping = 0;
+static int writerSleeping = 0;     // writer is (about to be) waiting for 'wake'
+static pthread_mutex_t wakeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+static pthread_t writer;
+static int writerRunning = 0;
+
+static void *writerMain(void *arg);
+static void waitForRecords();
+static void wakeWriter();
+static int drainRing(char *batch, unsigned int *droppedSeen);
+static void writeAll(const char *bytes, int length);
+
+/*
+ * logInit:
+ *   Sets the run-time level and starts the writer thread. Anything already
+ *   written to stdout through stdio is flushed first so it stays in order.
+ *   The writer blocks every signal, so SIGINT and SIGTERM reach the main
+ *   thread (and end its wait for events). logShutdown() is registered to run
+ *   at exit, so queued messages are not lost when the server exits - the
+ *   server stops on SIGINT and SIGTERM by returning from main().
+ */
+void logInit(int level) {
+    logLevel = level;
+    fflush(stdout);
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    if (pthread_create(&writer, NULL, writerMain, NULL) != 0) {
+        perror("pthread_create");
+        exit(-1);
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    writerRunning = 1;
+    atexit(logShutdown);
+}
+
+/*
+ * logWrite:
+ *   Renders the message into the next free record and publishes it, waking
+ *   the writer if it is asleep. Never waits for the writer to catch up: if
+ *   it is a full ring behind, the message is counted as dropped instead.
+ */
+void logWrite(int level, const char *format, ...) {
+    unsigned int head = ringHead;
+
+    if (head - __atomic_load_n(&ringTail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+        __atomic_store_n(&dropped, dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct logRecord *record = &ring[head & (LOG_RING_SLOTS - 1)];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(record->text, LOG_TEXT_SIZE, format, args);
+    va_end(args);
+    if (length < 0)
+        length = 0;
+    record->level = level;
+    record->length = length < LOG_TEXT_SIZE ? length : LOG_TEXT_SIZE - 1;
+    __atomic_store_n(&ringHead, head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&writerSleeping, __ATOMIC_SEQ_CST))
+        wakeWriter();
+}
+
+/*
+ * logShutdown:
+ *   Lets the writer thread write out every queued message, then stops it.
+ *   Safe to call more than once.
+ */
+void logShutdown() {
+    if (!writerRunning)
+        return;
+    __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+    wakeWriter();
+    pthread_join(writer, NULL);
+    writerRunning = 0;
+}
+
+/*
+ * writerMain:
+ *   The writer thread: drains the ring in batches, sleeping whenever it is
+ *   empty, until logShutdown() asks it to stop and nothing is left.
+ */
+static void *writerMain(void *arg) {
+    static char batch[LOG_BATCH_SIZE];
+    unsigned int droppedSeen = 0;
+
+    (void) arg;
+    while (1) {
+        int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+        int length = drainRing(batch, &droppedSeen);
+        if (length > 0)
+            writeAll(batch, length);
+        else if (stop)
+            break;
+        else
+            waitForRecords();
+    }
+    return NULL;
+}
+
+/*
+ * waitForRecords:
+ *   Sleeps until the ring holds a record or logShutdown() has been called.
+ */
+static void waitForRecords() {
+    pthread_mutex_lock(&wakeLock);
+    __atomic_store_n(&writerSleeping, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&ringHead, __ATOMIC_SEQ_CST) == ringTail &&
+           !__atomic_load_n(&stopping, __ATOMIC_SEQ_CST))
+        pthread_cond_wait(&wake, &wakeLock);
+    __atomic_store_n(&writerSleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&wakeLock);
+}
+
+/*
+ * wakeWriter:
+ *   Wakes the writer thread if it is waiting. Taking the lock orders the
+ *   signal after its last check of the ring, so the wakeup cannot be missed.
+ */
+static void wakeWriter() {
+    pthread_mutex_lock(&wakeLock);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&wakeLock);
+}
+
+/*
+ * drainRing:
+ *   Formats as many queued records as fit into 'batch' ("[LEVEL] text\n"
+ *   each), preceded by a warning if messages were dropped since the last
+ *   call, and hands their slots back to the logging thread.
+ *   Returns the number of bytes placed in 'batch'.
+ */
+static int drainRing(char *batch, unsigned int *droppedSeen) {
+    static const char *const tags[] = { "", "[WARN] ", "[INFO] ", "[DEBUG] " };
+    unsigned int head = __atomic_load_n(&ringHead, __ATOMIC_ACQUIRE);
+    unsigned int tail = ringTail;
+    unsigned int lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    int length = 0;
+
+    if (lost != *droppedSeen) {
+        length = snprintf(batch, LOG_BATCH_SIZE, "[WARN] %u log messages dropped.\n", lost - *droppedSeen);
+        *droppedSeen = lost;
+    }
+
+    while (tail != head) {
+        struct logRecord *record = &ring[tail & (LOG_RING_SLOTS - 1)];
+        const char *tag = tags[record->level];
+        int tagLength = strlen(tag);
+        if (length + tagLength + record->length + 1 > LOG_BATCH_SIZE)
+            break;
+        memcpy(batch + length, tag, tagLength);
+        memcpy(batch + length + tagLength, record->text, record->length);
+        length += tagLength + record->length;
+        batch[length++] = '\n';
+        tail++;
+    }
+    __atomic_store_n(&ringTail, tail, __ATOMIC_RELEASE);
+    return length;
+}
+
+/*
+ * writeAll:
+ *   Writes the whole buffer to stdout, retrying short writes. Errors are
+ *   ignored: there is nowhere left to report them.
+ */
+static void writeAll(const char *bytes, int length) {
+    while (length > 0) {
+        ssize_t written = write(STDOUT_FILENO, bytes, length);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        bytes += written;
+        length -= written;
+    }
+}
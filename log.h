@@ -0,0 +1,67 @@
+/******************************************************************************
+ * log.h
+ *
+ * Asynchronous logger for the server.
+ *
+ * LOG_WARN(), LOG_INFO() and LOG_DEBUG() take printf-style arguments. The
+ * caller only renders the message into a slot of a lock-free ring buffer;
+ * a background thread adds the level tag and writes whatever has piled up
+ * to stdout in one write() per batch, so a slow pipe or disk never stalls
+ * the thread that logs. If the ring is full the message is dropped (and
+ * the number of drops reported later) rather than waiting.
+ *
+ * The ring has a single producer: log from one thread only.
+ *
+ * Levels above LOG_LEVEL (set at build time, e.g. make LOG_LEVEL=2) are
+ * compiled out: their calls, arguments included, disappear. Of the levels
+ * compiled in, those above the one given to logInit() are skipped at run
+ * time with a single comparison.
+ *
+ * Functions:
+ *    logInit(level) – starts the writer thread; messages above 'level' are skipped.
+ *    logWrite(level, format, ...) – queues a message (use the LOG_* macros instead).
+ *    logShutdown() – writes out everything queued and stops the writer thread.
+ *
+ * Author: Robin Simpson
+ * Lab Section: 3 pm
+ *****************************************************************************/
+
+#ifndef LOG_H
+#define LOG_H
+
+#define LOG_LEVEL_WARN   1
+#define LOG_LEVEL_INFO   2
+#define LOG_LEVEL_DEBUG  3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG  // highest level compiled in
+#endif
+
+extern int logLevel;               // highest level logged at run time
+
+void logInit(int level);
+void logWrite(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void logShutdown();
+
+#define LOG_AT(level, ...) \
+    do { if (logLevel >= (level)) logWrite((level), __VA_ARGS__); } while (0)
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...)  do { } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...)  LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...)  do { } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,189 @@
+/******************************************************************************
+ * metrics.c
+ *
+ * Storage, recording and Prometheus rendering of the metrics registry.
+ *
+ * Author: Robin Simpson
+ * Lab Section: 3 pm
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include "safeUtil.h"
+#include "metrics.h"
+
+/* Text being rendered by metricsRender() */
+struct text {
+    char *bytes;
+    int length;
+    int capacity;
+};
+
+static void appendf(struct text *text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void renderByFlag(struct text *text, const char *name, const char *help, const uint64_t *counters);
+static void renderHistogram(struct text *text, const char *name, const char *label,
+                            const struct metricHistogram *histogram, double scale);
+
+uint64_t metricCounters[METRIC_COUNTERS];
+
+const char *const metricCounterNames[METRIC_COUNTERS] = {
+    [METRIC_ACCEPTS]              = "chat_accepts_total",
+    [METRIC_DISCONNECTS]          = "chat_disconnects_total",
+    [METRIC_DROPS]                = "chat_dropped_clients_total",
+    [METRIC_REGISTRATIONS]        = "chat_registrations_total",
+    [METRIC_REGISTRATION_REJECTS] = "chat_registration_rejects_total",
+    [METRIC_BYTES_IN]             = "chat_bytes_in_total",
+    [METRIC_BYTES_OUT]            = "chat_bytes_out_total",
+};
+
+const char *const metricCounterHelp[METRIC_COUNTERS] = {
+    [METRIC_ACCEPTS]              = "Connections accepted.",
+    [METRIC_DISCONNECTS]          = "Connections closed, for any reason.",
+    [METRIC_DROPS]                = "Clients dropped for a failed send or a full outbound queue.",
+    [METRIC_REGISTRATIONS]        = "Handles registered.",
+    [METRIC_REGISTRATION_REJECTS] = "Registrations refused (handle too long, duplicate, no id left).",
+    [METRIC_BYTES_IN]             = "Bytes of PDUs received, headers included.",
+    [METRIC_BYTES_OUT]            = "Bytes of PDUs handed to the send path, headers included.",
+};
+
+uint64_t metricPdusIn[METRIC_FLAGS];
+uint64_t metricPdusOut[METRIC_FLAGS];
+
+struct metricHistogram metricHandlerNs[METRIC_FLAGS];
+struct metricHistogram metricFanout;
+
+/*
+ * metricObserve:
+ *   Counts 'value' in its log2 bucket and adds it to the histogram's sum.
+ */
+void metricObserve(struct metricHistogram *histogram, uint64_t value) {
+    int bucket = value ? 64 - __builtin_clzll(value) : 0;
+
+    if (bucket >= METRIC_BUCKETS)
+        bucket = METRIC_BUCKETS - 1;
+    metricAdd(histogram->buckets[bucket], 1);
+    metricAdd(histogram->count, 1);
+    metricAdd(histogram->sum, value);
+}
+
+/*
+ * metricNow:
+ *   Returns CLOCK_MONOTONIC in nanoseconds (read without a system call on Linux).
+ */
+uint64_t metricNow() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/*
+ * metricsRender:
+ *   Renders the counters, the given gauges and the histograms in the Prometheus
+ *   text exposition format (version 0.0.4). Per-flag series are only listed for
+ *   flags that have been seen. Histogram buckets are cumulative with upper
+ *   bounds 2^i - 1; handler times are converted to seconds.
+ *
+ * Returns:
+ *   The text (malloc()ed, for the caller to free()), its length in *length.
+ */
+char *metricsRender(const struct metricGauge *gauges, int gaugeCount, int *length) {
+    struct text text = { NULL, 0, 0 };
+
+    for (int i = 0; i < METRIC_COUNTERS; i++) {
+        appendf(&text, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", metricCounterNames[i], metricCounterHelp[i],
+                metricCounterNames[i], metricCounterNames[i],
+                (unsigned long long) __atomic_load_n(&metricCounters[i], __ATOMIC_RELAXED));
+    }
+    renderByFlag(&text, "chat_pdus_in_total", "PDUs received, by packet flag.", metricPdusIn);
+    renderByFlag(&text, "chat_pdus_out_total", "Packets handed to the send path, by (first) packet flag.",
+                 metricPdusOut);
+
+    for (int i = 0; i < gaugeCount; i++) {
+        appendf(&text, "# HELP %s %s\n# TYPE %s gauge\n%s %.17g\n", gauges[i].name, gauges[i].help,
+                gauges[i].name, gauges[i].name, gauges[i].value);
+    }
+
+    appendf(&text, "# HELP chat_handler_duration_seconds Time to handle one PDU, by packet flag.\n"
+                   "# TYPE chat_handler_duration_seconds histogram\n");
+    for (int flag = 0; flag < METRIC_FLAGS; flag++) {
+        if (__atomic_load_n(&metricHandlerNs[flag].count, __ATOMIC_RELAXED) == 0)
+            continue;
+        char label[32];
+        snprintf(label, sizeof(label), "flag=\"%d\",", flag);
+        renderHistogram(&text, "chat_handler_duration_seconds", label, &metricHandlerNs[flag], 1e-9);
+    }
+    appendf(&text, "# HELP chat_fanout_recipients Recipients of each relayed message.\n"
+                   "# TYPE chat_fanout_recipients histogram\n");
+    renderHistogram(&text, "chat_fanout_recipients", "", &metricFanout, 1);
+
+    *length = text.length;
+    return text.bytes;
+}
+
+/*
+ * renderByFlag:
+ *   Renders a per-flag counter, one series for each flag with a non-zero count.
+ */
+static void renderByFlag(struct text *text, const char *name, const char *help, const uint64_t *counters) {
+    appendf(text, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (int flag = 0; flag < METRIC_FLAGS; flag++) {
+        uint64_t value = __atomic_load_n(&counters[flag], __ATOMIC_RELAXED);
+        if (value != 0)
+            appendf(text, "%s{flag=\"%d\"} %llu\n", name, flag, (unsigned long long) value);
+    }
+}
+
+/*
+ * renderHistogram:
+ *   Renders the cumulative buckets, sum and count of one histogram. 'label' is
+ *   put in front of the le label of every series (empty, or e.g. 'flag="4",'),
+ *   and bounds and sum are multiplied by 'scale'.
+ */
+static void renderHistogram(struct text *text, const char *name, const char *label,
+                            const struct metricHistogram *histogram, double scale) {
+    uint64_t cumulative = 0;
+
+    for (int i = 0; i < METRIC_BUCKETS - 1; i++) {
+        cumulative += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        appendf(text, "%s_bucket{%sle=\"%.9g\"} %llu\n", name, label, (double) ((1ull << i) - 1) * scale,
+                (unsigned long long) cumulative);
+    }
+    cumulative += __atomic_load_n(&histogram->buckets[METRIC_BUCKETS - 1], __ATOMIC_RELAXED);
+    appendf(text, "%s_bucket{%sle=\"+Inf\"} %llu\n", name, label, (unsigned long long) cumulative);
+
+    /* The label list without its trailing comma, for the _sum and _count series */
+    int labelLength = label[0] ? (int) strlen(label) - 1 : 0;
+    const char *open = label[0] ? "{" : "";
+    const char *close = label[0] ? "}" : "";
+    appendf(text, "%s_sum%s%.*s%s %.9g\n", name, open, labelLength, label, close,
+            (double) __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) * scale);
+    appendf(text, "%s_count%s%.*s%s %llu\n", name, open, labelLength, label, close,
+            (unsigned long long) cumulative);
+}
+
+/*
+ * appendf:
+ *   printf()s onto the end of the text, growing it as needed.
+ */
+static void appendf(struct text *text, const char *format, ...) {
+    va_list args;
+
+    while (1) {
+        int room = text->capacity - text->length;
+        va_start(args, format);
+        int needed = vsnprintf(text->bytes ? text->bytes + text->length : NULL, room, format, args);
+        va_end(args);
+        if (needed < room) {
+            text->length += needed;
+            return;
+        }
+        text->capacity = text->capacity ? text->capacity * 2 : 16 * 1024;
+        while (text->capacity - text->length <= needed)
+            text->capacity *= 2;
+        text->bytes = srealloc(text->bytes, text->capacity);
+    }
+}
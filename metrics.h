@@ -0,0 +1,78 @@
+/******************************************************************************
+ * metrics.h
+ *
+ * The server's metrics: counters and log2-bucketed histograms.
+ *
+ * Everything is a fixed array updated in place with relaxed atomic adds,
+ * so recording costs a few nanoseconds and no allocation, lock or system
+ * call, and another thread can read the values at any time without
+ * tearing them. Names and help texts are kept alongside for whatever
+ * exports them.
+ *
+ * Histogram bucket i counts the values v with 2^(i-1) <= v < 2^i (bucket 0
+ * counts v == 0; the last bucket also takes everything larger), plus the
+ * total count and sum of all values.
+ *
+ * Functions:
+ *    metricAdd(counter, n) – adds n to a counter (any uint64_t below).
+ *    metricObserve(histogram, value) – records one value in a histogram.
+ *    metricNow() – returns a monotonic time in nanoseconds, for timing.
+ *    metricsRender(gauges, count, &length) – renders everything in Prometheus text format.
+ *
+ * Author: Robin Simpson
+ * Lab Section: 3 pm
+ *****************************************************************************/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+/* Plain counters, by id */
+enum metricCounterId {
+    METRIC_ACCEPTS,                  // connections accepted
+    METRIC_DISCONNECTS,              // connections closed, for any reason
+    METRIC_DROPS,                    // clients dropped for a failed send or a full queue
+    METRIC_REGISTRATIONS,            // handles registered
+    METRIC_REGISTRATION_REJECTS,     // registrations refused (too long, duplicate, no id left)
+    METRIC_BYTES_IN,                 // bytes of PDUs received, headers included
+    METRIC_BYTES_OUT,                // bytes of PDUs handed to the send path, headers included
+    METRIC_COUNTERS
+};
+
+#define METRIC_FLAGS    32           // packet flags with a counter (and handler histogram) of their own
+#define METRIC_BUCKETS  40           // histogram buckets: up to 2^39 (ns: ~9 minutes)
+
+struct metricHistogram {
+    uint64_t buckets[METRIC_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+};
+
+extern uint64_t metricCounters[METRIC_COUNTERS];
+extern const char *const metricCounterNames[METRIC_COUNTERS];
+extern const char *const metricCounterHelp[METRIC_COUNTERS];
+
+extern uint64_t metricPdusIn[METRIC_FLAGS];    // PDUs received, by flag (larger flags under 0)
+extern uint64_t metricPdusOut[METRIC_FLAGS];   // packets sent, by flag (a multi-PDU frame counts once, under its first flag)
+
+extern struct metricHistogram metricHandlerNs[METRIC_FLAGS];  // time to handle a PDU, by flag
+extern struct metricHistogram metricFanout;                   // recipients per relayed message
+
+#define metricAdd(counter, n)  __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+/* Index into the per-flag arrays */
+#define metricFlag(flag)       ((flag) < METRIC_FLAGS ? (flag) : 0)
+
+/* A point-in-time value supplied by the caller of metricsRender() */
+struct metricGauge {
+    const char *name;
+    const char *help;
+    double value;
+};
+
+void metricObserve(struct metricHistogram *histogram, uint64_t value);
+uint64_t metricNow();
+char *metricsRender(const struct metricGauge *gauges, int gaugeCount, int *length);
+
+#endif
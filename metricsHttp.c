@@ -0,0 +1,285 @@
+/******************************************************************************
+ * metricsHttp.c
+ *
+ * Implementation of the metrics HTTP listener.
+ *
+ * A scrape connection first collects its request into 'request' (only the
+ * request line matters, the rest is read up to the blank line and ignored),
+ * then gets the whole response - rendered in one go into 'response' - and
+ * is closed once that has been sent. HTTP/1.0 with Connection: close, so
+ * there is no keep-alive or chunking to handle. Anything the scraper sends
+ * while its response is going out is read and thrown away.
+ *
+ * Author: Robin Simpson
+ * Lab Section: 3 pm
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "pollLib.h"
+#include "log.h"
+#include "metricsHttp.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define HTTP_REQUEST_MAX 2048          // longest request head read
+#define HTTP_GAUGES_MAX  16
+
+struct httpConnection {
+    int fd;                            // -1 if the slot is free
+    unsigned long opened;              // order of acceptance, to find the oldest
+    int requestLength;
+    char request[HTTP_REQUEST_MAX + 1];
+    char *response;                    // NULL while the request is being read
+    int responseLength;
+    int responseSent;
+};
+
+static int listenFd = -1;
+static metricsGaugeSource gaugeSource = NULL;
+static struct httpConnection connections[METRICS_HTTP_CONNECTIONS];
+static unsigned long accepted = 0;
+
+static void acceptScrape();
+static void readRequest(struct httpConnection *conn);
+static void respond(struct httpConnection *conn);
+static void sendResponse(struct httpConnection *conn);
+static int discardInput(struct httpConnection *conn);
+static void closeScrape(struct httpConnection *conn);
+
+/*
+ * metricsHttpOpen:
+ *   Creates the non-blocking listening socket on the loopback address, adds
+ *   it to the poll set and remembers where the gauges come from.
+ */
+void metricsHttpOpen(int port, metricsGaugeSource gauges) {
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    int on = 1;
+
+    gaugeSource = gauges;
+    for (int i = 0; i < METRICS_HTTP_CONNECTIONS; i++)
+        connections[i].fd = -1;
+
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        perror("metrics socket call");
+        exit(-1);
+    }
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (bind(listenFd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        perror("metrics bind call");
+        exit(-1);
+    }
+    if (listen(listenFd, METRICS_HTTP_CONNECTIONS) < 0 ||
+        getsockname(listenFd, (struct sockaddr *) &address, &addressLength) < 0) {
+        perror("metrics listen call");
+        exit(-1);
+    }
+    if (fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        exit(-1);
+    }
+    addToPollSet(listenFd);
+    LOG_INFO("Metrics at http://127.0.0.1:%d/metrics", ntohs(address.sin_port));
+}
+
+/*
+ * metricsHttpService:
+ *   Takes one step for a ready socket: accepts a scrape on the listening
+ *   socket, or reads the request of / sends the response to a scrape.
+ *
+ * Returns:
+ *   1 if 'fd' belongs to the listener, 0 if not (nothing was done).
+ */
+int metricsHttpService(int fd, short revents) {
+    if (fd < 0)
+        return 0;
+    if (fd == listenFd) {
+        acceptScrape();
+        return 1;
+    }
+    for (int i = 0; i < METRICS_HTTP_CONNECTIONS; i++) {
+        struct httpConnection *conn = &connections[i];
+        if (conn->fd != fd)
+            continue;
+        if (conn->response == NULL)
+            readRequest(conn);
+        else if (revents & (POLLERR | POLLHUP))
+            closeScrape(conn);   /* the scraper is gone: there is no one to send the rest to */
+        else if ((!(revents & POLLIN) || discardInput(conn)) && (revents & POLLOUT))
+            sendResponse(conn);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * acceptScrape:
+ *   Accepts a connection into a free slot, closing the oldest scrape first
+ *   if every slot is taken.
+ */
+static void acceptScrape() {
+    int fd = accept(listenFd, NULL, NULL);
+    if (fd < 0)
+        return;   /* EAGAIN (someone else's wakeup) or the client already gave up */
+
+    struct httpConnection *slot = &connections[0];
+    for (int i = 0; i < METRICS_HTTP_CONNECTIONS; i++) {
+        if (connections[i].fd < 0) {
+            slot = &connections[i];
+            break;
+        }
+        if (connections[i].opened < slot->opened)
+            slot = &connections[i];
+    }
+    if (slot->fd >= 0)
+        closeScrape(slot);
+
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        close(fd);
+        return;
+    }
+    slot->fd = fd;
+    slot->opened = accepted++;
+    slot->requestLength = 0;
+    slot->response = NULL;
+    addToPollSet(fd);
+}
+
+/*
+ * readRequest:
+ *   Reads what the scraper sent and responds once the request head is
+ *   complete (or has grown too long to be a scrape).
+ */
+static void readRequest(struct httpConnection *conn) {
+    int n = recv(conn->fd, conn->request + conn->requestLength, HTTP_REQUEST_MAX - conn->requestLength,
+                 MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n <= 0) {
+        closeScrape(conn);
+        return;
+    }
+    conn->requestLength += n;
+    conn->request[conn->requestLength] = '\0';
+    if (strstr(conn->request, "\r\n\r\n") != NULL || strstr(conn->request, "\n\n") != NULL ||
+        conn->requestLength == HTTP_REQUEST_MAX)
+        respond(conn);
+}
+
+/*
+ * respond:
+ *   Builds the response for the request line: the metrics for GET /metrics,
+ *   404 for any other GET path, 405 for any other method. Then starts
+ *   sending it.
+ */
+static void respond(struct httpConnection *conn) {
+    const char *status = "200 OK";
+    char *body = NULL;
+    int bodyLength = 0;
+
+    if (strncmp(conn->request, "GET ", 4) != 0) {
+        status = "405 Method Not Allowed";
+    } else if (strncmp(conn->request + 4, "/metrics", 8) != 0 ||
+               (conn->request[12] != ' ' && conn->request[12] != '?' && conn->request[12] != '\r' &&
+                conn->request[12] != '\n')) {
+        status = "404 Not Found";
+    } else {
+        struct metricGauge gauges[HTTP_GAUGES_MAX];
+        int gaugeCount = gaugeSource ? gaugeSource(gauges, HTTP_GAUGES_MAX) : 0;
+        body = metricsRender(gauges, gaugeCount, &bodyLength);
+    }
+
+    char head[256];
+    int headLength = snprintf(head, sizeof(head),
+                              "HTTP/1.0 %s\r\n"
+                              "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                              "Content-Length: %d\r\n"
+                              "Connection: close\r\n\r\n", status, bodyLength);
+    conn->response = malloc(headLength + bodyLength);
+    if (conn->response == NULL) {
+        free(body);
+        closeScrape(conn);
+        return;
+    }
+    memcpy(conn->response, head, headLength);
+    if (body != NULL)
+        memcpy(conn->response + headLength, body, bodyLength);
+    free(body);
+    conn->responseLength = headLength + bodyLength;
+    conn->responseSent = 0;
+    sendResponse(conn);
+}
+
+/*
+ * sendResponse:
+ *   Sends as much of the response as the socket takes. Closes the scrape
+ *   when it is all sent (or the send fails); otherwise waits for POLLOUT.
+ *   Input still unread at the close would make the kernel reset the
+ *   connection, discarding response bytes the scraper has not read yet,
+ *   so whatever has arrived is drained first.
+ */
+static void sendResponse(struct httpConnection *conn) {
+    while (conn->responseSent < conn->responseLength) {
+        int n = send(conn->fd, conn->response + conn->responseSent, conn->responseLength - conn->responseSent,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            setPollWriteInterest(conn->fd, 1);
+            return;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        conn->responseSent += n;
+    }
+    while (recv(conn->fd, conn->request, HTTP_REQUEST_MAX, MSG_DONTWAIT) > 0)
+        ;
+    closeScrape(conn);
+}
+
+/*
+ * discardInput:
+ *   Reads and drops input that arrives after the request (e.g. a pipelined
+ *   second request), into the request buffer, which is no longer needed.
+ *   Closes the scrape if the scraper has shut down its side or the read fails.
+ *
+ * Returns:
+ *   1 if the connection is still open, 0 if it was closed.
+ */
+static int discardInput(struct httpConnection *conn) {
+    int n = recv(conn->fd, conn->request, HTTP_REQUEST_MAX, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 1;
+    if (n <= 0) {
+        closeScrape(conn);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * closeScrape:
+ *   Closes the connection and frees its slot.
+ */
+static void closeScrape(struct httpConnection *conn) {
+    removeFromPollSet(conn->fd);
+    close(conn->fd);
+    free(conn->response);
+    conn->response = NULL;
+    conn->fd = -1;
+}
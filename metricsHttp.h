@@ -0,0 +1,38 @@
+/******************************************************************************
+ * metricsHttp.h
+ *
+ * Minimal HTTP listener serving the metrics registry (metrics.h) in the
+ * Prometheus text format at GET /metrics.
+ *
+ * It runs inside the server's poll loop: the listening socket and every
+ * scrape connection are non-blocking and in the same poll set as the chat
+ * sockets, each wakeup does one bounded step (an accept, a recv, a send),
+ * and a connection is closed as soon as its response has been written.
+ * At most METRICS_HTTP_CONNECTIONS scrapes are open at once; accepting one
+ * more closes the oldest, so idle or stalled scrapers cannot pile up.
+ *
+ * Functions:
+ *    metricsHttpOpen(port, gauges) – starts listening on 127.0.0.1:port (0: any free port).
+ *    metricsHttpService(fd, revents) – handles a ready socket if it is one of the listener's.
+ *
+ * Author: Robin Simpson
+ * Lab Section: 3 pm
+ *****************************************************************************/
+
+#ifndef METRICSHTTP_H
+#define METRICSHTTP_H
+
+#include "metrics.h"
+
+#define METRICS_HTTP_CONNECTIONS 8     // scrapes served at the same time
+
+/*
+ * Fills in up to 'max' gauges with current values for a scrape and
+ * returns how many it filled in.
+ */
+typedef int (*metricsGaugeSource)(struct metricGauge *gauges, int max);
+
+void metricsHttpOpen(int port, metricsGaugeSource gauges);
+int metricsHttpService(int fd, short revents);  // Returns 0 if 'fd' is not the listener's.
+
+#endif
@@ -19,6 +19,8 @@
 #include "networks.h"
 #include "gethostbyname.h"
 
+static int tcpAcceptPeer(int mainServerSocket, struct sockaddr_in6 *peerAddress, int debugFlag);
+
 
 
 // This function sets the server socket. The function returns the server
@@ -74,6 +76,16 @@ int tcpServerSetup(int serverPort)
 // the client socket number.   
 
 int tcpAccept(int mainServerSocket, int debugFlag)
+{
+	struct sockaddr_in6 clientAddress;
+
+	return tcpAcceptPeer(mainServerSocket, &clientAddress, debugFlag);
+}
+
+// Same as tcpAccept(), also filling in the client's address as accept()
+// reports it.
+
+static int tcpAcceptPeer(int mainServerSocket, struct sockaddr_in6 *peerAddress, int debugFlag)
 {
 	struct sockaddr_in6 clientAddress;   
 	int clientAddressSize = sizeof(clientAddress);
@@ -91,6 +103,7 @@ int tcpAccept(int mainServerSocket, int debugFlag)
 				getIPAddressString6(clientAddress.sin6_addr.s6_addr), ntohs(clientAddress.sin6_port));
 	}
 	
+	*peerAddress = clientAddress;
 
 	return(client_socket);
 }
@@ -4,51 +4,118 @@
 #include <string.h>
 #include <arpa/inet.h>   // htons, ntohs
 #include <errno.h>
-#include <sys/socket.h>  // send(), recv()
+#include <sys/socket.h>  // sendmsg(), recv()
 
-#include "safeUtil.h"    // for safeSend(), safeRecv()
+#include "safeUtil.h"    // sPool
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0           // not on macOS, a dead peer raises SIGPIPE there
+#endif
 
 /*
- * sendPDU():
- *   Build the total PDU: 2-byte length header (in network order) + payload.
- *   Send it in ONE send() call. Return data-bytes-sent (excluding header),
- *   or -1 if an error is detected.
+ * buildHeader():
+ *   Checks the payload pieces (count, total length) for the function named by
+ *   'caller', writes the 2-byte length header and lays out iov as header
+ *   followed by the pieces. Returns the payload length, or -1.
  */
-int sendPDU(int socketNumber, const uint8_t *dataBuffer, int lengthOfData)
+static int buildHeader(uint8_t *header, struct iovec *iov, const struct iovec *parts, int partCount,
+                       const char *caller)
 {
-    // totalLen includes the 2-byte header + the actual payload
-    int totalLen = lengthOfData + 2;
+    int lengthOfData = 0;
+    int i = 0;
 
-    // Allocate a temporary buffer to build the entire PDU
-    // can allocate array with max buffer instead due to overhead reasons (or c99 total length arr)
-    uint8_t *pdu = (uint8_t*)malloc(totalLen);
-    if (!pdu)
+    if (partCount > PDU_MAX_PARTS)
     {
-        perror("sendPDU malloc");
-        exit(-1);
+        fprintf(stderr, "%s: %d parts exceeds %d\n", caller, partCount, PDU_MAX_PARTS);
+        return -1;
+    }
+    for (i = 0; i < partCount; i++)
+    {
+        lengthOfData += parts[i].iov_len;
+    }
+    if (lengthOfData > PDU_MAX_PAYLOAD)
+    {
+        fprintf(stderr, "%s: payload %d exceeds %d\n", caller, lengthOfData, PDU_MAX_PAYLOAD);
+        return -1;
     }
 
-    // Convert totalLen to network order, store in first 2 bytes
-    uint16_t netLen = htons(totalLen);
-    memcpy(pdu, &netLen, 2);
-
-    // Copy user data after the 2-byte header
-    memcpy(pdu + 2, dataBuffer, lengthOfData);
+    // totalLen includes the 2-byte header + the actual payload
+    uint16_t netLen = htons(lengthOfData + PDU_HEADER_LEN);
+    memcpy(header, &netLen, PDU_HEADER_LEN);
 
-    // Send in one call. safeSend() either returns bytesSent or exits on error
-    int bytesSent = safeSend(socketNumber, pdu, totalLen, 0);
+    iov[0].iov_base = header;
+    iov[0].iov_len = PDU_HEADER_LEN;
+    memcpy(iov + 1, parts, partCount * sizeof(struct iovec));
+    return lengthOfData;
+}
 
-    free(pdu);
+/*
+ * sendPDUv():
+ *   1) Add up the payload pieces => payload length, check it fits a PDU
+ *   2) iov[0] = 2-byte length header (network order), iov[1..] = the pieces
+ *   3) sendmsg() the whole vector; if it comes up short (signal), advance past
+ *      what went out and send the rest
+ *   Return data-bytes-sent (excluding header), or -1 if an error is detected.
+ */
+int sendPDUv(int socketNumber, const struct iovec *parts, int partCount)
+{
+    struct iovec iov[1 + PDU_MAX_PARTS];
+    struct msghdr msg;
+    uint8_t header[PDU_HEADER_LEN];
+    int lengthOfData = buildHeader(header, iov, parts, partCount, "sendPDUv");
 
-    // If safeSend() doesn’t exit on error, it might return <0; handle it:
-    if (bytesSent < 0) 
+    if (lengthOfData < 0)
     {
         return -1;
     }
 
-    // bytesSent should match totalLen on success
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = partCount + 1;
+
+    int remaining = lengthOfData + PDU_HEADER_LEN;
+    while (remaining > 0)
+    {
+        int bytesSent = sendmsg(socketNumber, &msg, MSG_NOSIGNAL);
+        if (bytesSent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("sendPDUv");
+            return -1;
+        }
+        remaining -= bytesSent;
+
+        // skip the pieces (or the part of one) that already went out
+        while (msg.msg_iovlen > 0 && bytesSent >= (int) msg.msg_iov->iov_len)
+        {
+            bytesSent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (uint8_t *) msg.msg_iov->iov_base + bytesSent;
+            msg.msg_iov->iov_len -= bytesSent;
+        }
+    }
+
     // We only return how many DATA bytes were sent
-    return (bytesSent - 2);
+    return lengthOfData;
+}
+
+/*
+ * sendPDU():
+ *   Single-piece sendPDUv().
+ */
+int sendPDU(int socketNumber, const uint8_t *dataBuffer, int lengthOfData)
+{
+    struct iovec part;
+    part.iov_base = (void *) dataBuffer;
+    part.iov_len = lengthOfData;
+    return sendPDUv(socketNumber, &part, 1);
 }
 
 /*
@@ -131,3 +198,493 @@ int recvPDU(int socketNumber, uint8_t *dataBuffer, int bufferSize)
     // success => ret == payloadLen
     return payloadLen;
 }
+
+/*
+ * The shared bulk read buffer. There is room in front of the PDU_READ_SIZE bytes
+ * for the partial frame a connection carries into its next read, so that frame
+ * and the bytes completing it end up contiguous.
+ */
+static uint8_t bulkBuffer[PDU_HEADER_LEN + PDU_MAX_PAYLOAD + PDU_READ_SIZE];
+static struct pduDecoder *bulkOwner = NULL;   // decoder whose bytes are in bulkBuffer
+
+static int frameLength(const uint8_t *frame);
+static void parkDecoder(struct pduDecoder *decoder);
+static int fillDecoder(struct pduDecoder *decoder, int socketNumber);
+
+/*
+ * pduDecoderInit():
+ *   Nothing buffered, nothing saved.
+ */
+void pduDecoderInit(struct pduDecoder *decoder)
+{
+    decoder->next = NULL;
+    decoder->available = 0;
+    decoder->drained = 0;
+    decoder->saved = NULL;
+}
+
+/*
+ * pduDecoderRelease():
+ *   Drop the saved bytes and give up the shared buffer if we hold it.
+ */
+void pduDecoderRelease(struct pduDecoder *decoder)
+{
+    if (bulkOwner == decoder)
+    {
+        bulkOwner = NULL;
+    }
+    free(decoder->saved);
+    pduDecoderInit(decoder);
+}
+
+/*
+ * pduDecode():
+ *   1) If a complete frame is buffered => hand it out, no system call
+ *   2) If the last recv() came up short => the socket is drained, return 0
+ *      (the next call, once the socket is ready again, reads)
+ *   3) Otherwise read more with fillDecoder() and try again
+ */
+int pduDecode(struct pduDecoder *decoder, int socketNumber, uint8_t **payload)
+{
+    while (1)
+    {
+        if (decoder->available >= PDU_HEADER_LEN)
+        {
+            int totalLen = frameLength(decoder->next);
+
+            // an empty payload carries no flag byte, treat it like an oversized one
+            if (totalLen <= PDU_HEADER_LEN || totalLen - PDU_HEADER_LEN > PDU_MAX_PAYLOAD)
+            {
+                return PDU_BAD_FRAME;
+            }
+            if (decoder->available >= totalLen)
+            {
+                *payload = decoder->next + PDU_HEADER_LEN;
+                decoder->next += totalLen;
+                decoder->available -= totalLen;
+                return totalLen - PDU_HEADER_LEN;
+            }
+        }
+
+        if (decoder->drained)
+        {
+            decoder->drained = 0;
+            return 0;
+        }
+
+        int ret = fillDecoder(decoder, socketNumber);
+        if (ret <= 0)
+        {
+            return ret;
+        }
+    }
+}
+
+/*
+ * frameLength():
+ *   Total PDU length (header included) from the 2-byte network order header.
+ */
+static int frameLength(const uint8_t *frame)
+{
+    uint16_t netLen = 0;
+    memcpy(&netLen, frame, PDU_HEADER_LEN);
+    return ntohs(netLen);
+}
+
+/*
+ * parkDecoder():
+ *   Another connection is about to reuse the shared buffer, so copy this
+ *   decoder's unconsumed bytes into its own storage.
+ */
+static void parkDecoder(struct pduDecoder *decoder)
+{
+    if (decoder->available > 0)
+    {
+        uint8_t *copy = (uint8_t *) malloc(decoder->available);
+        if (!copy)
+        {
+            perror("parkDecoder malloc");
+            exit(-1);
+        }
+        memcpy(copy, decoder->next, decoder->available);
+        decoder->saved = copy;
+        decoder->next = copy;
+    }
+}
+
+/*
+ * fillDecoder():
+ *   1) Take over the shared buffer, parking the previous owner's bytes
+ *   2) Move our partial frame (always < one max frame) to the front of it
+ *   3) recv() up to PDU_READ_SIZE bytes right behind that with MSG_DONTWAIT
+ *   Returns bytes read (> 0), 0 if nothing was queued, or PDU_CLOSED.
+ */
+static int fillDecoder(struct pduDecoder *decoder, int socketNumber)
+{
+    int carried = decoder->available;
+    int ret = 0;
+
+    if (bulkOwner != decoder)
+    {
+        if (bulkOwner != NULL)
+        {
+            parkDecoder(bulkOwner);
+        }
+        bulkOwner = decoder;
+    }
+
+    if (carried > 0)
+    {
+        memmove(bulkBuffer, decoder->next, carried);
+    }
+    free(decoder->saved);
+    decoder->saved = NULL;
+    decoder->next = bulkBuffer;
+
+    do
+    {
+        ret = recv(socketNumber, bulkBuffer + carried, PDU_READ_SIZE, MSG_DONTWAIT);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return 0;
+        }
+        // On some OS, ECONNRESET => treat as closed
+        if (errno != ECONNRESET)
+        {
+            perror("pduDecode");
+        }
+        return PDU_CLOSED;
+    }
+    if (ret == 0)
+    {
+        // means other side closed
+        return PDU_CLOSED;
+    }
+
+    decoder->available = carried + ret;
+    decoder->drained = (ret < PDU_READ_SIZE);
+    return ret;
+}
+
+/*
+ * Queue entries come from a pool: one is taken per recipient of every queued
+ * frame, so recycling them keeps fan-out to slow readers off malloc().
+ */
+#define QUEUE_ENTRIES_PER_CHUNK 1024
+
+static struct sPool queueEntryPool;
+static int queueEntryPoolReady = 0;
+
+/*
+ * pduFrameAlloc():
+ *   One allocation for the frame and its bytes, refs = 1 for the caller.
+ */
+struct pduFrame *pduFrameAlloc(int capacity)
+{
+    struct pduFrame *frame = (struct pduFrame *) malloc(sizeof(struct pduFrame) + capacity);
+    if (!frame)
+    {
+        perror("pduFrameAlloc malloc");
+        exit(-1);
+    }
+
+    frame->refs = 1;
+    frame->length = 0;
+    frame->capacity = capacity;
+    return frame;
+}
+
+/*
+ * pduFrameAppendv():
+ *   1) Header + pieces as one iovec, like sendPDUv()
+ *   2) Check it fits behind what the frame holds already
+ *   3) Copy header and pieces in, one after the other
+ */
+int pduFrameAppendv(struct pduFrame *frame, const struct iovec *parts, int partCount)
+{
+    struct iovec iov[1 + PDU_MAX_PARTS];
+    uint8_t header[PDU_HEADER_LEN];
+    int lengthOfData = buildHeader(header, iov, parts, partCount, "pduFrameAppendv");
+    int i = 0;
+
+    if (lengthOfData < 0)
+    {
+        return -1;
+    }
+    if (frame->length + lengthOfData + PDU_HEADER_LEN > frame->capacity)
+    {
+        fprintf(stderr, "pduFrameAppendv: frame full (%d of %d bytes used)\n", frame->length, frame->capacity);
+        return -1;
+    }
+
+    for (i = 0; i <= partCount; i++)
+    {
+        memcpy(frame->bytes + frame->length, iov[i].iov_base, iov[i].iov_len);
+        frame->length += iov[i].iov_len;
+    }
+    return lengthOfData;
+}
+
+/*
+ * pduFrameCreate():
+ *   A frame sized for exactly one PDU, holding it.
+ */
+struct pduFrame *pduFrameCreate(const uint8_t *dataBuffer, int lengthOfData)
+{
+    struct pduFrame *frame = pduFrameAlloc(lengthOfData + PDU_HEADER_LEN);
+    struct iovec part;
+
+    part.iov_base = (void *) dataBuffer;
+    part.iov_len = lengthOfData;
+    pduFrameAppendv(frame, &part, 1);
+    return frame;
+}
+
+/*
+ * pduFrameRetain():
+ *   One more reference.
+ */
+struct pduFrame *pduFrameRetain(struct pduFrame *frame)
+{
+    frame->refs++;
+    return frame;
+}
+
+/*
+ * pduFrameRelease():
+ *   Last reference gone => free.
+ */
+void pduFrameRelease(struct pduFrame *frame)
+{
+    if (--frame->refs == 0)
+    {
+        free(frame);
+    }
+}
+
+/*
+ * pduQueueInit():
+ *   No frames, nothing partly sent.
+ */
+void pduQueueInit(struct pduQueue *queue)
+{
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->sent = 0;
+    queue->pending = 0;
+}
+
+/*
+ * pduQueuePush():
+ *   New entry (from the pool) at the tail, holding its own reference to the frame.
+ */
+void pduQueuePush(struct pduQueue *queue, struct pduFrame *frame)
+{
+    if (!queueEntryPoolReady)
+    {
+        sPoolInit(&queueEntryPool, sizeof(struct pduQueueEntry), QUEUE_ENTRIES_PER_CHUNK);
+        queueEntryPoolReady = 1;
+    }
+    struct pduQueueEntry *entry = (struct pduQueueEntry *) sPoolAlloc(&queueEntryPool);
+
+    frame->refs++;
+    queue->pending += frame->length;
+    entry->frame = frame;
+    entry->next = NULL;
+    if (queue->tail)
+    {
+        queue->tail->next = entry;
+    }
+    else
+    {
+        queue->head = entry;
+    }
+    queue->tail = entry;
+}
+
+/*
+ * popFrame():
+ *   Removes the head entry and drops its reference.
+ */
+static void popFrame(struct pduQueue *queue)
+{
+    struct pduQueueEntry *entry = queue->head;
+
+    queue->head = entry->next;
+    if (queue->head == NULL)
+    {
+        queue->tail = NULL;
+    }
+    queue->sent = 0;
+    pduFrameRelease(entry->frame);
+    sPoolFree(&queueEntryPool, entry);
+}
+
+/*
+ * queueRest():
+ *   Queue the frame, the first 'bytesSent' bytes of which already went out
+ *   (only possible with an empty queue, so the frame is then the head).
+ */
+static void queueRest(struct pduQueue *queue, struct pduFrame *frame, int bytesSent)
+{
+    pduQueuePush(queue, frame);
+    if (bytesSent > 0)
+    {
+        queue->sent = bytesSent;
+        queue->pending -= bytesSent;
+    }
+}
+
+/*
+ * pduQueueSent():
+ *   1) Send failed => -1
+ *   2) All of the bytes went out => done, nothing copied
+ *   3) Else queue the frame (for wire bytes: the shared copy of the one PDU,
+ *      created if no earlier recipient needed it) and note how much of it
+ *      already went out
+ */
+int pduQueueSent(struct pduQueue *queue, const uint8_t *bytes, int length, int bytesSent,
+                 struct pduFrame **frame)
+{
+    if (bytesSent < 0)
+    {
+        return -1;
+    }
+    if (bytesSent == length)
+    {
+        return 0;
+    }
+
+    if (*frame == NULL)
+    {
+        *frame = pduFrameCreate(bytes + PDU_HEADER_LEN, length - PDU_HEADER_LEN);
+    }
+    queueRest(queue, *frame, bytesSent);
+    return 1;
+}
+
+/*
+ * pduQueueSendv():
+ *   1) Header + pieces as one iovec, like sendPDUv()
+ *   2) Nothing queued => sendmsg() it without waiting, done if it all went out
+ *   3) Else gather header + pieces into a new frame and queue it, noting how
+ *      much of it already went out
+ */
+int pduQueueSendv(struct pduQueue *queue, int socketNumber, const struct iovec *parts, int partCount)
+{
+    struct iovec iov[1 + PDU_MAX_PARTS];
+    struct msghdr msg;
+    uint8_t header[PDU_HEADER_LEN];
+    int lengthOfData = buildHeader(header, iov, parts, partCount, "pduQueueSendv");
+    int bytesSent = 0;
+
+    if (lengthOfData < 0)
+    {
+        return -1;
+    }
+
+    if (queue->head == NULL)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = partCount + 1;
+        do
+        {
+            bytesSent = sendmsg(socketNumber, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        } while (bytesSent < 0 && errno == EINTR);
+
+        if (bytesSent == lengthOfData + PDU_HEADER_LEN)
+        {
+            return 0;
+        }
+        if (bytesSent < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("pduQueueSendv");
+                return -1;
+            }
+            bytesSent = 0;
+        }
+    }
+
+    struct pduFrame *frame = pduFrameAlloc(lengthOfData + PDU_HEADER_LEN);
+    pduFrameAppendv(frame, parts, partCount);
+    queueRest(queue, frame, bytesSent);
+    pduFrameRelease(frame);
+    return 1;
+}
+
+/*
+ * pduQueueFlush():
+ *   1) Gather up to PDU_MAX_PARTS queued frames (the rest of the head frame
+ *      first) into one iovec and sendmsg() it
+ *   2) Pop every frame that went out completely, remember how far into the
+ *      new head frame we got
+ *   3) Repeat until the queue is empty, the socket would block or it fails
+ */
+int pduQueueFlush(struct pduQueue *queue, int socketNumber)
+{
+    struct iovec iov[PDU_MAX_PARTS];
+    struct msghdr msg;
+
+    while (queue->head)
+    {
+        struct pduQueueEntry *entry = queue->head;
+        int count = 0;
+
+        iov[0].iov_base = entry->frame->bytes + queue->sent;
+        iov[0].iov_len = entry->frame->length - queue->sent;
+        for (count = 1, entry = entry->next; entry && count < PDU_MAX_PARTS; entry = entry->next, count++)
+        {
+            iov[count].iov_base = entry->frame->bytes;
+            iov[count].iov_len = entry->frame->length;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        int bytesSent = sendmsg(socketNumber, &msg, MSG_NOSIGNAL);
+        if (bytesSent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 1;
+            }
+            perror("pduQueueFlush");
+            return -1;
+        }
+        queue->pending -= bytesSent;
+
+        while (queue->head && bytesSent >= queue->head->frame->length - queue->sent)
+        {
+            bytesSent -= queue->head->frame->length - queue->sent;
+            popFrame(queue);
+        }
+        queue->sent += bytesSent;
+    }
+
+    return 0;
+}
+
+/*
+ * pduQueueClear():
+ *   Pop everything, sent or not.
+ */
+void pduQueueClear(struct pduQueue *queue)
+{
+    while (queue->head)
+    {
+        popFrame(queue);
+    }
+    queue->pending = 0;
+}
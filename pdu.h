@@ -2,13 +2,25 @@
 #define PDU_H
 
 #include <stdint.h>
+#include <sys/uio.h>     // struct iovec
+
+#define PDU_HEADER_LEN   2       // 2-byte big-endian total length
+#define PDU_MAX_PAYLOAD  1400    // largest payload sent or accepted
+#define PDU_MAX_PARTS    32      // most payload pieces sendPDUv() accepts
 
 /*
- * sendPDU():
- *   Creates a 2-byte big-endian length header, places the payload after that header,
- *   and sends it in ONE send() call.
+ * sendPDUv():
+ *   Sends one PDU whose payload is the concatenation of partCount pieces.
+ *   The 2-byte big-endian length header and the pieces go out in ONE sendmsg()
+ *   gather write: no heap allocation and no copy of the payload.
  *   Return value: the number of data bytes sent (not counting the 2-byte header),
- *                 or -1 if an error occurs.
+ *                 or -1 if an error occurs (including a payload over PDU_MAX_PAYLOAD).
+ */
+int sendPDUv(int socketNumber, const struct iovec *parts, int partCount);
+
+/*
+ * sendPDU():
+ *   sendPDUv() with the payload in a single buffer.
  */
 int sendPDU(int socketNumber, const uint8_t *dataBuffer, int lengthOfData);
 
@@ -24,4 +36,169 @@ int sendPDU(int socketNumber, const uint8_t *dataBuffer, int lengthOfData);
  */
 int recvPDU(int socketNumber, uint8_t *dataBuffer, int bufferSize);
 
+/*
+ * Non-blocking bulk PDU decoder.
+ *   One recv() pulls up to PDU_READ_SIZE bytes into a read buffer shared by all
+ *   connections, and every complete PDU in it is handed out without further
+ *   system calls. Bytes a connection has not consumed yet (a partial frame, or
+ *   frames left over when the caller stops early) move into that connection's
+ *   pduDecoder only when another connection needs the shared buffer, so a peer
+ *   that stalls halfway through a PDU never blocks the caller and idle
+ *   connections hold no buffer at all.
+ */
+#define PDU_READ_SIZE    (64 * 1024)  // bytes requested per recv()
+
+#define PDU_CLOSED      -1       // peer closed the connection or a socket error occurred
+#define PDU_BAD_FRAME   -2       // length header is invalid or exceeds PDU_MAX_PAYLOAD
+
+struct pduDecoder {
+    uint8_t *next;               // first unconsumed byte (in the shared buffer or in 'saved')
+    int available;               // unconsumed bytes at 'next'
+    int drained;                 // last recv() came up short, the socket has nothing more
+    uint8_t *saved;              // this connection's own copy of unconsumed bytes, or NULL
+};
+
+/*
+ * pduDecoderInit():
+ *   Sets up an empty decoder for a new connection.
+ */
+void pduDecoderInit(struct pduDecoder *decoder);
+
+/*
+ * pduDecoderRelease():
+ *   Frees what the decoder holds. Call before discarding it (connection closed).
+ */
+void pduDecoderRelease(struct pduDecoder *decoder);
+
+/*
+ * pduDecode():
+ *   Hands out the next complete PDU, reading from the socket (never blocking)
+ *   only when no complete PDU is buffered.
+ *   Return value: payload length (> 0) with *payload pointing at the payload.
+ *                 The 2-byte header sits right in front of it. Both stay valid
+ *                 until the next pduDecode() call on any decoder.
+ *                 0 if no complete PDU is available (wait for the socket to be ready),
+ *                 PDU_CLOSED or PDU_BAD_FRAME if the connection should be dropped.
+ */
+int pduDecode(struct pduDecoder *decoder, int socketNumber, uint8_t **payload);
+
+/*
+ * Shared outbound frames.
+ *   A pduFrame is one fully encoded PDU (header + payload), or several back
+ *   to back, in a single allocation. It is reference counted so the same frame can sit on the
+ *   outbound queue of every recipient: a broadcast or multicast is framed
+ *   once, each recipient only costs a queue entry, and the frame is freed
+ *   when the last queue holding it has sent it (or been cleared).
+ */
+struct pduFrame {
+    int refs;                    // queue entries (plus the creator) holding the frame
+    int length;                  // bytes in use: complete PDUs, each header + payload
+    int capacity;                // bytes allocated
+    uint8_t bytes[];
+};
+
+struct pduQueueEntry {
+    struct pduFrame *frame;
+    struct pduQueueEntry *next;
+};
+
+struct pduQueue {
+    struct pduQueueEntry *head;  // oldest frame, the one being sent
+    struct pduQueueEntry *tail;
+    int sent;                    // bytes of head->frame already written
+    int pending;                 // bytes queued and not yet written
+};
+
+/*
+ * pduFrameAlloc():
+ *   Creates an empty frame with room for 'capacity' bytes of PDUs, holding
+ *   one reference for the caller, who drops it with pduFrameRelease() once
+ *   the frame is queued (or no longer kept).
+ */
+struct pduFrame *pduFrameAlloc(int capacity);
+
+/*
+ * pduFrameAppendv():
+ *   Encodes one more PDU, its payload given as pieces like for sendPDUv(),
+ *   at the end of the frame.
+ *   Return value: the payload length, or -1 if it is invalid or does not fit.
+ */
+int pduFrameAppendv(struct pduFrame *frame, const struct iovec *parts, int partCount);
+
+/*
+ * pduFrameCreate():
+ *   Encodes header + payload into a new frame of exactly that size, holding
+ *   one reference for the caller (see pduFrameAlloc()).
+ */
+struct pduFrame *pduFrameCreate(const uint8_t *dataBuffer, int lengthOfData);
+
+/*
+ * pduFrameRetain():
+ *   Takes one more reference to the frame (dropped with pduFrameRelease()).
+ *   Return value: the frame.
+ */
+struct pduFrame *pduFrameRetain(struct pduFrame *frame);
+
+/*
+ * pduFrameRelease():
+ *   Drops one reference, freeing the frame with the last one.
+ */
+void pduFrameRelease(struct pduFrame *frame);
+
+/*
+ * pduQueueInit():
+ *   Sets up an empty outbound queue.
+ */
+void pduQueueInit(struct pduQueue *queue);
+
+/*
+ * pduQueuePush():
+ *   Appends the frame to the queue, which takes its own reference.
+ */
+void pduQueuePush(struct pduQueue *queue, struct pduFrame *frame);
+
+/*
+ * pduQueueSent():
+ *   Finishes a send the caller made itself (e.g. as part of a pollSendBatch()):
+ *   'bytesSent' of the 'length' bytes went out (what send() returned, -1 for
+ *   a socket error), the rest is queued. With bytesSent 0 this just queues
+ *   the bytes, behind anything queued already. '*frame' is the frame holding
+ *   the bytes or, for received bytes (a single PDU, header included), NULL
+ *   or a shared copy made for an earlier recipient. A copy made here is left
+ *   in *frame so later recipients of the same bytes queue it too; the caller
+ *   releases it when done.
+ *   Return value: 0 if the bytes were sent in full,
+ *                 1 if (the rest of) them were queued: flush the queue later,
+ *                 -1 on a socket error.
+ */
+int pduQueueSent(struct pduQueue *queue, const uint8_t *bytes, int length, int bytesSent,
+                 struct pduFrame **frame);
+
+/*
+ * pduQueueSendv():
+ *   Queued counterpart of sendPDUv() for non-blocking sockets. If nothing is
+ *   queued the PDU is written right away; whatever the socket does not take
+ *   is copied into a frame of its own and queued behind earlier frames.
+ *   Return value: 0 if the PDU was sent in full,
+ *                 1 if (the rest of) it was queued: flush the queue later,
+ *                 -1 on a socket error or an invalid payload.
+ */
+int pduQueueSendv(struct pduQueue *queue, int socketNumber, const struct iovec *parts, int partCount);
+
+/*
+ * pduQueueFlush():
+ *   Writes queued frames, several per sendmsg() call, releasing each one once
+ *   it is completely sent.
+ *   Return value: 0 if the queue is now empty,
+ *                 1 if the socket would block with frames still queued,
+ *                 -1 on a socket error (the queue is left as it is).
+ */
+int pduQueueFlush(struct pduQueue *queue, int socketNumber);
+
+/*
+ * pduQueueClear():
+ *   Releases every queued frame. Call before discarding the queue.
+ */
+void pduQueueClear(struct pduQueue *queue);
+
 #endif
@@ -3,34 +3,959 @@
 // Use at your own risk.  Feel free to copy, just leave my name in it.
 //
 
-// Note this is not a robust implementation 
-// 1. It is about as un-thread safe as you can write code.  If you 
+// Note this is not a robust implementation
+// 1. It is about as un-thread safe as you can write code.  If you
 //    are using pthreads do NOT use this code.
-// 2. pollCall() always returns the lowest available file descriptor 
-//    which could cause higher file descriptors to never be processed
+// 2. Ready descriptors are handed out round-robin.  The poll() backend
+//    resumes its scan after the last descriptor it reported, so a busy
+//    low descriptor can no longer starve the higher ones.  epoll() keeps
+//    its ready list in FIFO order already.
 //
-// This is for student projects so I don't intend on improving this. 
+// Three backends sit behind the same API, picked at build time:
+//    poll()     - portable, fd-indexed pollfd array scanned on every call
+//    epoll()    - Linux only (-DUSE_EPOLL), cost scales with the number of
+//                 ready descriptors instead of the highest descriptor.
+//                 Regular files and /dev/null (e.g. a redirected stdin),
+//                 which epoll refuses, are reported ready on every call,
+//                 the same as poll() does for them
+//    io_uring   - Linux 5.11+ (-DUSE_IO_URING), poll requests for every
+//                 socket ride the ring, so adding, removing and re-arming
+//                 sockets is batched into the one io_uring_enter() that
+//                 also waits for the next events.  Listening sockets get a
+//                 multishot accept (5.19+, else a poll) and a send batch
+//                 is one io_uring_enter() for all of its sendmsg requests
 
-#include <poll.h>
+#define _GNU_SOURCE    // accept4()
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#if defined(USE_IO_URING)
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#elif defined(USE_EPOLL)
+#include <sys/epoll.h>
+#endif
 
 #include "safeUtil.h"
 #include "pollLib.h"
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0     // not on macOS
+#endif
+
+// shared by the backends (after the last one)
+static void setNonBlocking(int socketNumber);
+static int acceptNonBlocking(int socketNumber, struct sockaddr * address, socklen_t * addressLength);
+
+
+#if defined(USE_IO_URING)
+
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+// user_data: a poll or an accept carries its slot's generation and the
+// socket number, a send of a batch its index in the batch
+#define URING_INTERNAL (~0ULL)      // requests whose completion we ignore
+#define URING_SEND     (1ULL << 63)
+#define URING_ACCEPT   (1ULL << 62)
+#define URING_GENERATION_MASK 0x3fffffffU
+
+// Per socket state, indexed by socket number
+struct uringSlot {
+	unsigned generation;    // bumped on every add/remove so stale completions can be spotted
+	char registered;        // socket is in the poll set
+	char armed;             // a poll (or accept) request for it is on the ring
+	char listener;          // a multishot accept is used instead of a poll
+	char held;              // waiting in the held list to be handed out
+	short events;           // POLLIN, plus POLLOUT while write interest is set
+};
+
+// A connection the multishot accept of a listener produced
+struct uringAccepted {
+	int listener;
+	int socketNumber;
+};
+
+// io_uring global variables (raw system calls, liburing is not needed)
+static int ringFileDescriptor = -1;
+static unsigned sqEntries = 0;
+static unsigned * sqHead, * sqTail, * sqMask, * sqArray;
+static struct io_uring_sqe * submissionEntries;
+static unsigned * cqHead, * cqTail, * cqMask;
+static struct io_uring_cqe * completionEntries;
+static unsigned sqLocalTail = 0;       // our copy of the tail, published before each enter
+static unsigned sqPending = 0;         // requests queued but not yet submitted
+
+static struct uringSlot * slots;
+static int slotCount = 0;
+static int * rearmList;                // sockets handed out by the last call
+static int rearmCount = 0;
+static int rearmSize = 0;
+static struct pollReady * heldList;    // reaped events not handed out yet
+static int heldCount = 0;
+static int heldSize = 0;
+static struct uringAccepted * acceptedList;    // accepted, not yet taken by pollAccept()
+static int acceptedCount = 0;
+static int acceptedSize = 0;
+static int multishotAccept = 1;        // cleared if the kernel turns it down (before 5.19)
+
+static struct pollSend * sendBatch;    // the batch pollSendBatch() is waiting for
+static int sendsOutstanding = 0;
+static struct msghdr * sendHeaders;    // sendmsg() arguments of the batch, one per send
+static struct iovec * sendVectors;
+static int sendHeaderSize = 0;
+
+static void uringEnter(unsigned minComplete, unsigned flags, void * arg, size_t argSize);
+static struct io_uring_sqe * getSubmissionEntry();
+static uint64_t slotUserData(int socketNumber);
+static void armPoll(int socketNumber);
+static void cancelPoll(int socketNumber);
+static void holdReady(int socketNumber, short revents);
+static void rearmLater(int socketNumber);
+static void reapCompletions();
+static int handOut(struct pollReady * readyList, int maxReady);
+
+// Poll functions (setup, add, remove, call)
+void setupPollSet()
+{
+	struct io_uring_params params;
+	size_t sqRingSize = 0;
+	size_t cqRingSize = 0;
+	uint8_t * sqRing = NULL;
+	uint8_t * cqRing = NULL;
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_CQ_ENTRIES;
+
+	if ((ringFileDescriptor = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params)) < 0)
+	{
+		perror("io_uring_setup");
+		exit(-1);
+	}
+	if (!(params.features & IORING_FEAT_EXT_ARG))
+	{
+		printf("Error - io_uring backend needs Linux 5.11 or newer\n");
+		exit(-1);
+	}
+
+	// map the submission and completion rings (one mapping on newer kernels)
+	sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		sqRingSize = cqRingSize = (sqRingSize > cqRingSize) ? sqRingSize : cqRingSize;
+	}
+
+	sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ringFileDescriptor, IORING_OFF_SQ_RING);
+	if (sqRing == MAP_FAILED)
+	{
+		perror("mmap sq ring");
+		exit(-1);
+	}
+
+	cqRing = sqRing;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ringFileDescriptor, IORING_OFF_CQ_RING);
+		if (cqRing == MAP_FAILED)
+		{
+			perror("mmap cq ring");
+			exit(-1);
+		}
+	}
+
+	submissionEntries = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFileDescriptor, IORING_OFF_SQES);
+	if (submissionEntries == MAP_FAILED)
+	{
+		perror("mmap sqes");
+		exit(-1);
+	}
+
+	sqEntries = params.sq_entries;
+	sqHead = (unsigned *) (sqRing + params.sq_off.head);
+	sqTail = (unsigned *) (sqRing + params.sq_off.tail);
+	sqMask = (unsigned *) (sqRing + params.sq_off.ring_mask);
+	sqArray = (unsigned *) (sqRing + params.sq_off.array);
+	cqHead = (unsigned *) (cqRing + params.cq_off.head);
+	cqTail = (unsigned *) (cqRing + params.cq_off.tail);
+	cqMask = (unsigned *) (cqRing + params.cq_off.ring_mask);
+	completionEntries = (struct io_uring_cqe *) (cqRing + params.cq_off.cqes);
+	sqLocalTail = *sqTail;
+
+	slotCount = POLL_SET_SIZE;
+	slots = (struct uringSlot *) sCalloc(slotCount, sizeof(struct uringSlot));
+	rearmSize = POLL_EVENT_BATCH;
+	rearmList = (int *) sCalloc(rearmSize, sizeof(int));
+	heldSize = POLL_EVENT_BATCH;
+	heldList = (struct pollReady *) sCalloc(heldSize, sizeof(struct pollReady));
+}
+
+void addToPollSet(int socketNumber)
+{
+	int i = 0;
+
+	if (socketNumber >= slotCount)
+	{
+		slots = srealloc(slots, (socketNumber + POLL_SET_SIZE) * sizeof(struct uringSlot));
+		for (i = slotCount; i < socketNumber + POLL_SET_SIZE; i++)
+		{
+			memset(&slots[i], 0, sizeof(struct uringSlot));
+		}
+		slotCount = socketNumber + POLL_SET_SIZE;
+	}
+
+	if (slots[socketNumber].registered)
+	{
+		return;
+	}
+
+	slots[socketNumber].registered = 1;
+	slots[socketNumber].listener = 0;
+	slots[socketNumber].events = POLLIN;
+	slots[socketNumber].generation++;
+	armPoll(socketNumber);
+}
+
+void addListenerToPollSet(int socketNumber)
+{
+	// non-blocking for pollAccept()'s accept4() in case multishot
+	// accept turns out to be unsupported
+	setNonBlocking(socketNumber);
+	addToPollSet(socketNumber);
+
+	// replace the poll just queued by a multishot accept
+	if (multishotAccept && !slots[socketNumber].listener)
+	{
+		cancelPoll(socketNumber);
+		slots[socketNumber].listener = 1;
+		armPoll(socketNumber);
+	}
+}
+
+void removeFromPollSet(int socketNumber)
+{
+	int i = 0;
+	int kept = 0;
+
+	if (socketNumber >= slotCount || !slots[socketNumber].registered)
+	{
+		return;
+	}
+
+	cancelPoll(socketNumber);
+	slots[socketNumber].registered = 0;
+	slots[socketNumber].listener = 0;
+
+	// forget events held for it, and connections it accepted that nobody took
+	if (slots[socketNumber].held)
+	{
+		for (i = 0, kept = 0; i < heldCount; i++)
+		{
+			if (heldList[i].fd != socketNumber)
+			{
+				heldList[kept++] = heldList[i];
+			}
+		}
+		heldCount = kept;
+		slots[socketNumber].held = 0;
+	}
+	for (i = 0, kept = 0; i < acceptedCount; i++)
+	{
+		if (acceptedList[i].listener == socketNumber)
+		{
+			close(acceptedList[i].socketNumber);
+		}
+		else
+		{
+			acceptedList[kept++] = acceptedList[i];
+		}
+	}
+	acceptedCount = kept;
+}
+
+void setPollWriteInterest(int socketNumber, int enable)
+{
+	struct uringSlot * slot = NULL;
+	short events = enable ? (POLLIN | POLLOUT) : POLLIN;
+
+	if (socketNumber >= slotCount || !slots[socketNumber].registered)
+	{
+		return;
+	}
+	slot = &slots[socketNumber];
+
+	if (slot->events == events)
+	{
+		return;
+	}
+	slot->events = events;
+
+	// a poll on the ring still waits with the old mask, replace it.
+	// One that is not armed was handed out by the last call and gets
+	// the new mask when it is re-armed.
+	if (slot->armed && !slot->listener)
+	{
+		cancelPoll(socketNumber);
+		armPoll(socketNumber);
+	}
+}
+
+int pollCall(int timeInMilliSeconds)
+{
+	// returns the socket number if one is ready for read
+	// returns -1 if timeout occurred (or a signal arrived)
+	// if timeInMilliSeconds == -1 blocks forever (until a socket ready)
+	// If timeInMilliSeconds == 0 it will return immediately after looking at the poll set
+
+	struct pollReady ready;
+
+	if (pollCallMany(timeInMilliSeconds, &ready, 1) == 0)
+	{
+		return -1;
+	}
+
+	return ready.fd;
+}
+
+int pollCallMany(int timeInMilliSeconds, struct pollReady * readyList, int maxReady)
+{
+	// fills readyList with up to maxReady ready sockets and their revents
+	// returns the number filled in, 0 if timeout occurred (or a signal arrived)
+	// timeInMilliSeconds works the same as for pollCall()
+	//
+	// Polls are one-shot and re-armed here, after the caller has handled
+	// the sockets from the previous call.  That keeps poll()'s level
+	// triggered behaviour: data a handler left unread is reported again.
+
+	int i = 0;
+	int count = 0;
+	int socketNumber = 0;
+	struct __kernel_timespec timeout;
+	struct io_uring_getevents_arg waitArg;
+
+	for (i = 0; i < rearmCount; i++)
+	{
+		socketNumber = rearmList[i];
+		if (slots[socketNumber].registered && !slots[socketNumber].armed)
+		{
+			armPoll(socketNumber);
+		}
+	}
+	rearmCount = 0;
+
+	reapCompletions();
+	count = handOut(readyList, maxReady);
+
+	// nothing to submit and events already in hand - no system call needed
+	if (count > 0 && sqPending == 0)
+	{
+		return count;
+	}
+
+	if (count > 0 || timeInMilliSeconds == 0)
+	{
+		// just submit, do not wait
+		uringEnter(0, 0, NULL, 0);
+	}
+	else if (timeInMilliSeconds < 0)
+	{
+		uringEnter(1, IORING_ENTER_GETEVENTS, NULL, 0);
+	}
+	else
+	{
+		memset(&waitArg, 0, sizeof(waitArg));
+		timeout.tv_sec = timeInMilliSeconds / 1000;
+		timeout.tv_nsec = (timeInMilliSeconds % 1000) * 1000000L;
+		waitArg.sigmask_sz = _NSIG / 8;
+		waitArg.ts = (uint64_t) (uintptr_t) &timeout;
+		uringEnter(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &waitArg, sizeof(waitArg));
+	}
+
+	reapCompletions();
+	return count + handOut(readyList + count, maxReady - count);
+}
+
+int pollAccept(int socketNumber, struct sockaddr * address, socklen_t * addressLength)
+{
+	// hands out the connections the multishot accept queued (the accept
+	// cannot fill in one address per connection, getpeername() does),
+	// or accept()s one if the listener is polled instead
+
+	int i = 0;
+	int accepted = -1;
+
+	for (i = 0; i < acceptedCount; i++)
+	{
+		if (acceptedList[i].listener == socketNumber)
+		{
+			accepted = acceptedList[i].socketNumber;
+			memmove(&acceptedList[i], &acceptedList[i + 1], (acceptedCount - i - 1) * sizeof(struct uringAccepted));
+			acceptedCount--;
+			if (address != NULL && getpeername(accepted, address, addressLength) < 0)
+			{
+				// already reset by the peer - the caller sees that on the first read
+				memset(address, 0, *addressLength);
+			}
+			return accepted;
+		}
+	}
+
+	if (socketNumber < slotCount && slots[socketNumber].listener)
+	{
+		return -1;
+	}
+	return acceptNonBlocking(socketNumber, address, addressLength);
+}
+
+void pollSendBatch(struct pollSend * sends, int count)
+{
+	// queues one sendmsg() request per send, all submitted by the same
+	// io_uring_enter() that waits for their results.  MSG_DONTWAIT makes
+	// a full socket complete with -EAGAIN instead of waiting on the ring.
+	// Batches larger than the submission ring go in ring-sized pieces.
+
+	int i = 0;
+	int first = 0;
+	int chunk = 0;
+	struct io_uring_sqe * sqe = NULL;
+
+	if (count > sendHeaderSize)
+	{
+		sendHeaderSize = (count > URING_SQ_ENTRIES) ? count : URING_SQ_ENTRIES;
+		sendHeaders = srealloc(sendHeaders, sendHeaderSize * sizeof(struct msghdr));
+		sendVectors = srealloc(sendVectors, sendHeaderSize * sizeof(struct iovec));
+	}
+
+	sendBatch = sends;
+	for (first = 0; first < count; first += chunk)
+	{
+		chunk = (count - first < (int) sqEntries) ? count - first : (int) sqEntries;
+		for (i = first; i < first + chunk; i++)
+		{
+			sendVectors[i].iov_base = (void *) sends[i].bytes;
+			sendVectors[i].iov_len = sends[i].length;
+			memset(&sendHeaders[i], 0, sizeof(struct msghdr));
+			sendHeaders[i].msg_iov = &sendVectors[i];
+			sendHeaders[i].msg_iovlen = 1;
+
+			sqe = getSubmissionEntry();
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = sends[i].fd;
+			sqe->addr = (uint64_t) (uintptr_t) &sendHeaders[i];
+			sqe->len = 1;
+			sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+			sqe->user_data = URING_SEND | (uint64_t) i;
+		}
+
+		// polls completing meanwhile are held for the next pollCallMany()
+		sendsOutstanding = chunk;
+		while (sendsOutstanding > 0)
+		{
+			uringEnter(sendsOutstanding, IORING_ENTER_GETEVENTS, NULL, 0);
+			reapCompletions();
+		}
+	}
+	sendBatch = NULL;
+}
+
+static void uringEnter(unsigned minComplete, unsigned flags, void * arg, size_t argSize)
+{
+	int submitted = 0;
+
+	// make the queued entries visible to the kernel
+	__atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+
+	submitted = syscall(__NR_io_uring_enter, ringFileDescriptor, sqPending, minComplete, flags, arg, argSize);
+	if (submitted < 0)
+	{
+		// a timeout or a signal just means no events this time
+		if (errno == ETIME || errno == EINTR)
+		{
+			submitted = 0;
+		}
+		else
+		{
+			perror("io_uring_enter");
+			exit(-1);
+		}
+	}
+
+	sqPending -= (submitted < (int) sqPending) ? submitted : sqPending;
+}
+
+static struct io_uring_sqe * getSubmissionEntry()
+{
+	unsigned index = 0;
+	struct io_uring_sqe * sqe = NULL;
+
+	// ring full - push what is queued so far to make room
+	while (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+	{
+		uringEnter(0, 0, NULL, 0);
+	}
+
+	index = sqLocalTail & *sqMask;
+	sqe = &submissionEntries[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqArray[index] = index;
+	sqLocalTail++;
+	sqPending++;
+
+	return sqe;
+}
+
+static uint64_t slotUserData(int socketNumber)
+{
+	return ((uint64_t) (slots[socketNumber].generation & URING_GENERATION_MASK) << 32) | (uint32_t) socketNumber;
+}
+
+static void armPoll(int socketNumber)
+{
+	struct io_uring_sqe * sqe = getSubmissionEntry();
+
+	sqe->fd = socketNumber;
+	if (slots[socketNumber].listener)
+	{
+		// one request accepting connection after connection
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK;
+		sqe->user_data = URING_ACCEPT | slotUserData(socketNumber);
+	}
+	else
+	{
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = slots[socketNumber].events;
+		sqe->user_data = slotUserData(socketNumber);
+	}
+	slots[socketNumber].armed = 1;
+}
+
+static void cancelPoll(int socketNumber)
+{
+	struct io_uring_sqe * sqe = NULL;
+	struct uringSlot * slot = &slots[socketNumber];
+
+	// cancel the outstanding poll (or accept) by the user_data it was armed
+	// with.  Works even if the caller already closed the socket.
+	if (slot->armed)
+	{
+		sqe = getSubmissionEntry();
+		sqe->fd = -1;
+		if (slot->listener)
+		{
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = URING_ACCEPT | slotUserData(socketNumber);
+		}
+		else
+		{
+			sqe->opcode = IORING_OP_POLL_REMOVE;
+			sqe->addr = slotUserData(socketNumber);
+		}
+		sqe->user_data = URING_INTERNAL;
+	}
+
+	// completions still carrying the old generation are dropped on reap
+	slot->generation++;
+	slot->armed = 0;
+}
+
+static void holdReady(int socketNumber, short revents)
+{
+	if (slots[socketNumber].held)
+	{
+		return;
+	}
+
+	if (heldCount == heldSize)
+	{
+		heldSize *= 2;
+		heldList = srealloc(heldList, heldSize * sizeof(struct pollReady));
+	}
+	heldList[heldCount].fd = socketNumber;
+	heldList[heldCount].revents = revents;
+	heldCount++;
+	slots[socketNumber].held = 1;
+}
+
+static void rearmLater(int socketNumber)
+{
+	if (rearmCount == rearmSize)
+	{
+		rearmSize *= 2;
+		rearmList = srealloc(rearmList, rearmSize * sizeof(int));
+	}
+	rearmList[rearmCount++] = socketNumber;
+}
+
+static void reapCompletions()
+{
+	// empties the completion ring: results of the current send batch go
+	// into it, polls that fired and listeners with new connections are
+	// held until handOut() passes them on
+
+	int socketNumber = 0;
+	unsigned generation = 0;
+	unsigned head = *cqHead;
+	unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe * cqe = NULL;
+
+	while (head != tail)
+	{
+		cqe = &completionEntries[head & *cqMask];
+		head++;
+
+		if (cqe->user_data == URING_INTERNAL)
+		{
+			continue;
+		}
+
+		if (cqe->user_data & URING_SEND)
+		{
+			sendBatch[cqe->user_data & ~URING_SEND].result = cqe->res;
+			sendsOutstanding--;
+			continue;
+		}
+
+		socketNumber = (int) (cqe->user_data & 0xffffffff);
+		generation = (unsigned) ((cqe->user_data >> 32) & URING_GENERATION_MASK);
+
+		// completion of a request that was removed (or removed and re-added)
+		if (!slots[socketNumber].registered
+			|| (slots[socketNumber].generation & URING_GENERATION_MASK) != generation)
+		{
+			if ((cqe->user_data & URING_ACCEPT) && cqe->res >= 0)
+			{
+				close(cqe->res);
+			}
+			continue;
+		}
+
+		if (cqe->user_data & URING_ACCEPT)
+		{
+			if (cqe->res >= 0)
+			{
+				if (acceptedCount == acceptedSize)
+				{
+					acceptedSize = acceptedSize ? acceptedSize * 2 : POLL_EVENT_BATCH;
+					acceptedList = srealloc(acceptedList, acceptedSize * sizeof(struct uringAccepted));
+				}
+				acceptedList[acceptedCount].listener = socketNumber;
+				acceptedList[acceptedCount].socketNumber = cqe->res;
+				acceptedCount++;
+				holdReady(socketNumber, POLLIN);
+			}
+			else if (cqe->res == -EINVAL)
+			{
+				// no multishot accept on this kernel, poll listeners instead
+				multishotAccept = 0;
+				slots[socketNumber].listener = 0;
+			}
+
+			// the accept stopped (an error, or the kernel ended it) - start another
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+			{
+				slots[socketNumber].armed = 0;
+				rearmLater(socketNumber);
+			}
+			continue;
+		}
+
+		slots[socketNumber].armed = 0;
+		// a failed poll (res < 0) is reported as an error on the socket
+		holdReady(socketNumber, (cqe->res < 0) ? POLLERR : (short) cqe->res);
+	}
+
+	__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+static int handOut(struct pollReady * readyList, int maxReady)
+{
+	// passes on the oldest held events, each polled socket to be re-armed
+	// by the next pollCallMany()
+
+	int i = 0;
+	int count = (heldCount < maxReady) ? heldCount : maxReady;
+
+	for (i = 0; i < count; i++)
+	{
+		readyList[i] = heldList[i];
+		slots[readyList[i].fd].held = 0;
+		if (!slots[readyList[i].fd].listener)
+		{
+			rearmLater(readyList[i].fd);
+		}
+	}
+	heldCount -= count;
+	memmove(heldList, heldList + count, heldCount * sizeof(struct pollReady));
+
+	return count;
+}
+
+#elif defined(USE_EPOLL)
+
+// epoll global variables
+static int epollFileDescriptor = -1;
+static struct epoll_event * readyEvents;   // results of the last epoll_wait()
+static int readyCount = 0;                 // number of valid entries in readyEvents
+static int readyNext = 0;                  // next entry pollCall() hands out
+static struct pollReady * alwaysReady;     // descriptors epoll refuses (EPERM), always ready
+static int alwaysReadyCount = 0;
+static int alwaysReadySize = 0;
+
+static int findAlwaysReady(int socketNumber);
+
+// Poll functions (setup, add, remove, call)
+void setupPollSet()
+{
+	if ((epollFileDescriptor = epoll_create1(0)) < 0)
+	{
+		perror("epoll_create1");
+		exit(-1);
+	}
+	readyEvents = (struct epoll_event *) sCalloc(POLL_EVENT_BATCH, sizeof(struct epoll_event));
+	readyCount = 0;
+	readyNext = 0;
+}
+
+void addToPollSet(int socketNumber)
+{
+	struct epoll_event event;
+
+	event.events = EPOLLIN;
+	event.data.fd = socketNumber;
+
+	if (epoll_ctl(epollFileDescriptor, EPOLL_CTL_ADD, socketNumber, &event) < 0)
+	{
+		// a regular file or /dev/null - it never blocks, so poll() would
+		// always report it readable.  Do the same from a list of our own.
+		if (errno == EPERM)
+		{
+			if (findAlwaysReady(socketNumber) < 0)
+			{
+				if (alwaysReadyCount == alwaysReadySize)
+				{
+					alwaysReadySize = alwaysReadySize ? alwaysReadySize * 2 : POLL_SET_SIZE;
+					alwaysReady = srealloc(alwaysReady, alwaysReadySize * sizeof(struct pollReady));
+				}
+				alwaysReady[alwaysReadyCount].fd = socketNumber;
+				alwaysReady[alwaysReadyCount].revents = POLLIN;
+				alwaysReadyCount++;
+			}
+			return;
+		}
+
+		// already in the set - just refresh the interest mask
+		if (errno != EEXIST || epoll_ctl(epollFileDescriptor, EPOLL_CTL_MOD, socketNumber, &event) < 0)
+		{
+			perror("addToPollSet");
+			exit(-1);
+		}
+	}
+}
+
+void removeFromPollSet(int socketNumber)
+{
+	int i = findAlwaysReady(socketNumber);
+
+	if (i >= 0)
+	{
+		alwaysReady[i] = alwaysReady[--alwaysReadyCount];
+		return;
+	}
+
+	// callers may have already closed the socket, which drops it from
+	// the epoll set on its own (EBADF/ENOENT are expected then)
+	if (epoll_ctl(epollFileDescriptor, EPOLL_CTL_DEL, socketNumber, NULL) < 0
+		&& errno != EBADF && errno != ENOENT)
+	{
+		perror("removeFromPollSet");
+		exit(-1);
+	}
+
+	// forget events already collected for this socket so a reused
+	// descriptor number is not reported ready by a stale event
+	for (i = readyNext; i < readyCount; i++)
+	{
+		if (readyEvents[i].data.fd == socketNumber)
+		{
+			readyEvents[i].data.fd = -1;
+		}
+	}
+}
+
+void setPollWriteInterest(int socketNumber, int enable)
+{
+	struct epoll_event event;
+
+	int i = findAlwaysReady(socketNumber);
+
+	if (i >= 0)
+	{
+		alwaysReady[i].revents = enable ? (POLLIN | POLLOUT) : POLLIN;
+		return;
+	}
+
+	event.events = enable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+	event.data.fd = socketNumber;
+
+	if (epoll_ctl(epollFileDescriptor, EPOLL_CTL_MOD, socketNumber, &event) < 0)
+	{
+		perror("setPollWriteInterest");
+		exit(-1);
+	}
+}
+
+int pollCall(int timeInMilliSeconds)
+{
+	// returns the socket number if one is ready for read
+	// returns -1 if timeout occurred (or a signal arrived)
+	// if timeInMilliSeconds == -1 blocks forever (until a socket ready)
+	// If timeInMilliSeconds == 0 it will return immediately after looking at the poll set
+	//
+	// One epoll_wait() collects up to POLL_EVENT_BATCH ready sockets, later
+	// calls hand them out one at a time before waiting again.
+
+	int socketNumber = -1;
+
+	while (socketNumber < 0)
+	{
+		if (readyNext >= readyCount)
+		{
+			readyNext = 0;
+			if ((readyCount = epoll_wait(epollFileDescriptor, readyEvents, POLL_EVENT_BATCH,
+				alwaysReadyCount > 0 ? 0 : timeInMilliSeconds)) < 0)
+			{
+				// a signal just means no events this time
+				if (errno != EINTR)
+				{
+					perror("pollCall");
+					exit(-1);
+				}
+				readyCount = 0;
+			}
+
+			// timeout occurred (epoll_wait returned 0), unless a file is always ready
+			if (readyCount == 0)
+			{
+				if (alwaysReadyCount > 0)
+				{
+					socketNumber = alwaysReady[0].fd;
+				}
+				break;
+			}
+		}
+
+		// entries of removed sockets are marked -1, skip over them
+		socketNumber = readyEvents[readyNext++].data.fd;
+	}
+
+	// Ready socket # or -1 if timeout/none
+	return socketNumber;
+}
+
+int pollCallMany(int timeInMilliSeconds, struct pollReady * readyList, int maxReady)
+{
+	// fills readyList with up to maxReady ready sockets and their revents
+	// returns the number filled in, 0 if timeout occurred (or a signal arrived)
+	// timeInMilliSeconds works the same as for pollCall()
+
+	int i = 0;
+	int count = 0;
+	uint32_t events = 0;
+
+	// hand out whatever pollCall() left over first, only wait when none
+	// (and never when a file is always ready)
+	if (readyNext >= readyCount)
+	{
+		readyNext = 0;
+		if ((readyCount = epoll_wait(epollFileDescriptor, readyEvents, POLL_EVENT_BATCH,
+			alwaysReadyCount > 0 ? 0 : timeInMilliSeconds)) < 0)
+		{
+			// a signal just means no events this time
+			if (errno != EINTR)
+			{
+				perror("pollCallMany");
+				exit(-1);
+			}
+			readyCount = 0;
+		}
+	}
+
+	while (readyNext < readyCount && count < maxReady)
+	{
+		if (readyEvents[readyNext].data.fd >= 0)
+		{
+			events = readyEvents[readyNext].events;
+			readyList[count].fd = readyEvents[readyNext].data.fd;
+			readyList[count].revents = ((events & EPOLLIN) ? POLLIN : 0)
+				| ((events & EPOLLPRI) ? POLLPRI : 0)
+				| ((events & EPOLLOUT) ? POLLOUT : 0)
+				| ((events & EPOLLERR) ? POLLERR : 0)
+				| ((events & EPOLLHUP) ? POLLHUP : 0);
+			count++;
+		}
+		readyNext++;
+	}
+
+	// the always ready files fill whatever room is left
+	for (i = 0; i < alwaysReadyCount && count < maxReady; i++)
+	{
+		readyList[count++] = alwaysReady[i];
+	}
+
+	return count;
+}
+
+static int findAlwaysReady(int socketNumber)
+{
+	int i = 0;
+
+	for (i = 0; i < alwaysReadyCount; i++)
+	{
+		if (alwaysReady[i].fd == socketNumber)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+#else
 
 // Poll global variables 
 static struct pollfd * pollFileDescriptors;
 static int maxFileDescriptor = 0;
 static int currentPollSetSize = 0;
+static int scanStart = 0;          // where the next ready scan begins
 
 static void growPollSet(int newSetSize);
 
 // Poll functions (setup, add, remove, call)
 void setupPollSet()
 {
+	int i = 0;
+
 	currentPollSetSize = POLL_SET_SIZE;
 	pollFileDescriptors = (struct pollfd *) sCalloc(POLL_SET_SIZE, sizeof(struct pollfd));
+
+	// poll() ignores negative descriptors, fd 0 would be stdin
+	for (i = 0; i < POLL_SET_SIZE; i++)
+	{
+		pollFileDescriptors[i].fd = -1;
+	}
 }
 
 
@@ -56,34 +981,50 @@ void addToPollSet(int socketNumber)
 
 void removeFromPollSet(int socketNumber)
 {
-	pollFileDescriptors[socketNumber].fd = 0;
+	pollFileDescriptors[socketNumber].fd = -1;
 	pollFileDescriptors[socketNumber].events = 0;
+	pollFileDescriptors[socketNumber].revents = 0;
+}
+
+void setPollWriteInterest(int socketNumber, int enable)
+{
+	if (socketNumber < currentPollSetSize && pollFileDescriptors[socketNumber].fd >= 0)
+	{
+		pollFileDescriptors[socketNumber].events = enable ? (POLLIN | POLLOUT) : POLLIN;
+	}
 }
 
 int pollCall(int timeInMilliSeconds)
 {
 	// returns the socket number if one is ready for read
-	// returns -1 if timeout occurred
+	// returns -1 if timeout occurred (or a signal arrived)
 	// if timeInMilliSeconds == -1 blocks forever (until a socket ready)
 	// (this -1 is a feature of poll)
 	// If timeInMilliSeconds == 0 it will return immediately after looking at the poll set
 	
 	int i = 0;
+	int n = 0;
 	int returnValue = -1;
 	int pollValue = 0;
 	
 	if ((pollValue = poll(pollFileDescriptors, maxFileDescriptor, timeInMilliSeconds)) < 0)
 	{
-		perror("pollCall");
-		exit(-1);
+		// a signal just means no events this time
+		if (errno != EINTR)
+		{
+			perror("pollCall");
+			exit(-1);
+		}
+		pollValue = 0;
 	}	
 			
 	// check to see if timeout occurred (poll returned 0)
 	if (pollValue > 0)
 	{
-		// see which socket is ready
-		for (i = 0; i < maxFileDescriptor; i++)
+		// see which socket is ready, starting after the last one reported
+		for (n = 0; n < maxFileDescriptor; n++)
 		{
+			i = (scanStart + n) % maxFileDescriptor;
 			//if(pollFileDescriptors[i].revents & (POLLIN|POLLHUP|POLLNVAL)) 
 			//Could just check for specific revents, but want to catch all of them
 			//Otherwise, this could mask an error (eat the error condition)
@@ -91,6 +1032,7 @@ int pollCall(int timeInMilliSeconds)
 			{
 				//printf("for socket %d poll revents: %d\n", i, pollFileDescriptors[i].revents);
 				returnValue = i;
+				scanStart = i + 1;
 				break;
 			} 
 		}
@@ -101,6 +1043,47 @@ int pollCall(int timeInMilliSeconds)
 	return returnValue;
 }
 
+int pollCallMany(int timeInMilliSeconds, struct pollReady * readyList, int maxReady)
+{
+	// fills readyList with up to maxReady ready sockets and their revents
+	// returns the number filled in, 0 if timeout occurred (or a signal arrived)
+	// timeInMilliSeconds works the same as for pollCall()
+
+	int i = 0;
+	int n = 0;
+	int count = 0;
+	int pollValue = 0;
+	int start = scanStart;
+
+	if ((pollValue = poll(pollFileDescriptors, maxFileDescriptor, timeInMilliSeconds)) < 0)
+	{
+		// a signal just means no events this time
+		if (errno != EINTR)
+		{
+			perror("pollCallMany");
+			exit(-1);
+		}
+		pollValue = 0;
+	}
+
+	// poll() tells us how many are ready, stop scanning once all are found.
+	// When readyList is too small the scan resumes after the last socket
+	// reported, so the ones left out this time come first next time.
+	for (n = 0; n < maxFileDescriptor && count < pollValue && count < maxReady; n++)
+	{
+		i = (start + n) % maxFileDescriptor;
+		if (pollFileDescriptors[i].revents > 0)
+		{
+			readyList[count].fd = i;
+			readyList[count].revents = pollFileDescriptors[i].revents;
+			count++;
+			scanStart = i + 1;
+		}
+	}
+
+	return count;
+}
+
 static void growPollSet(int newSetSize)
 {
 	int i = 0;
@@ -119,12 +1102,89 @@ static void growPollSet(int newSetSize)
 	// zero out the new poll set elements
 	for (i = currentPollSetSize; i < newSetSize; i++)
 	{
-		pollFileDescriptors[i].fd = 0;
+		pollFileDescriptors[i].fd = -1;
 		pollFileDescriptors[i].events = 0;
+		pollFileDescriptors[i].revents = 0;
 	}
 	
 	currentPollSetSize = newSetSize;
 }
 
+#endif
+
+#if !defined(USE_IO_URING)
 
+// The readiness backends report a listener like any socket and accept()
+// when asked, and send one socket at a time
+
+void addListenerToPollSet(int socketNumber)
+{
+	// non-blocking so pollAccept() can be called until it runs dry
+	setNonBlocking(socketNumber);
+	addToPollSet(socketNumber);
+}
+
+int pollAccept(int socketNumber, struct sockaddr * address, socklen_t * addressLength)
+{
+	return acceptNonBlocking(socketNumber, address, addressLength);
+}
+
+void pollSendBatch(struct pollSend * sends, int count)
+{
+	int i = 0;
 
+	for (i = 0; i < count; i++)
+	{
+		do
+		{
+			sends[i].result = send(sends[i].fd, sends[i].bytes, sends[i].length, MSG_DONTWAIT | MSG_NOSIGNAL);
+		} while (sends[i].result < 0 && errno == EINTR);
+
+		if (sends[i].result < 0)
+		{
+			sends[i].result = -errno;
+		}
+	}
+}
+
+#endif
+
+static void setNonBlocking(int socketNumber)
+{
+	if (fcntl(socketNumber, F_SETFL, fcntl(socketNumber, F_GETFL) | O_NONBLOCK) < 0)
+	{
+		perror("fcntl");
+		exit(-1);
+	}
+}
+
+static int acceptNonBlocking(int socketNumber, struct sockaddr * address, socklen_t * addressLength)
+{
+	// returns the new connection, already non-blocking, or -1 if there is
+	// none (any more) or it went away before it was accepted
+
+	int accepted = -1;
+
+	do
+	{
+#ifdef SOCK_NONBLOCK
+		accepted = accept4(socketNumber, address, addressLength, SOCK_NONBLOCK);
+#else
+		accepted = accept(socketNumber, address, addressLength);
+#endif
+	} while (accepted < 0 && errno == EINTR);
+
+	if (accepted < 0)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+		{
+			perror("accept call");
+		}
+		return -1;
+	}
+
+#ifndef SOCK_NONBLOCK
+	setNonBlocking(accepted);
+#endif
+	return accepted;
+}
@@ -3,6 +3,15 @@
 //
 // Provides an interface to the poll() library.  Allows for
 // adding a file descriptor to the set, removing one and calling poll.
+// pollCallMany() reports every ready descriptor from a single call.
+// setPollWriteInterest() adds POLLOUT to a socket's interest while it has
+// output waiting, so writes that would block can resume when it drains.
+// addListenerToPollSet() and pollAccept() hand out the connections of a
+// listening socket, and pollSendBatch() makes many non-blocking sends at
+// once; with io_uring these are a multishot accept and one submission of
+// sendmsg requests for the whole batch.
+// Build with -DUSE_EPOLL or -DUSE_IO_URING to run the same interface on
+// top of epoll() or io_uring.
 // Feel free to copy, just leave my name in it, use at your own risk.
 //
 
@@ -10,12 +19,35 @@
 #ifndef __POLLLIB_H__
 #define __POLLLIB_H__
 
+#include <poll.h>
+#include <sys/socket.h>
+
 #define POLL_SET_SIZE 10
 #define POLL_WAIT_FOREVER -1
+#define POLL_EVENT_BATCH 64    // max ready sockets collected per epoll_wait()
+
+// One ready descriptor as reported by pollCallMany()
+struct pollReady {
+	int fd;
+	short revents;    // POLLIN, POLLOUT, POLLHUP, POLLERR ... (poll.h bits)
+};
+
+// One send of a pollSendBatch()
+struct pollSend {
+	int fd;
+	const void * bytes;
+	int length;
+	int result;       // filled in: bytes sent, or -errno (-EAGAIN: the socket is full)
+};
 
 void setupPollSet();
 void addToPollSet(int socketNumber);
 void removeFromPollSet(int socketNumber);
+void setPollWriteInterest(int socketNumber, int enable);    // also report POLLOUT while enable is set
 int pollCall(int timeInMilliSeconds);
+int pollCallMany(int timeInMilliSeconds, struct pollReady * readyList, int maxReady);
+void addListenerToPollSet(int socketNumber);    // a listening socket, reported ready when pollAccept() has connections
+int pollAccept(int socketNumber, struct sockaddr * address, socklen_t * addressLength);    // non-blocking socket or -1
+void pollSendBatch(struct pollSend * sends, int count);    // send() each without waiting, results in 'result'
 
 #endif
\ No newline at end of file
@@ -79,3 +79,47 @@ void * sCalloc(size_t nmemb, size_t size)
 	return returnValue;
 }
 
+void sPoolInit(struct sPool * pool, size_t objectSize, int objectsPerChunk)
+{
+	size_t align = 2 * sizeof(void *);    // what malloc() guarantees
+
+	// each free object holds the free list link
+	if (objectSize < sizeof(void *))
+	{
+		objectSize = sizeof(void *);
+	}
+
+	pool->objectSize = (objectSize + align - 1) / align * align;
+	pool->objectsPerChunk = objectsPerChunk;
+	pool->freeList = NULL;
+}
+
+void * sPoolAlloc(struct sPool * pool)
+{
+	void * returnValue = NULL;
+	int i = 0;
+
+	if (pool->freeList == NULL)
+	{
+		// free list empty - carve a new chunk into objects, in address
+		// order so consecutive allocations sit next to each other
+		uint8_t * chunk = sCalloc(pool->objectsPerChunk, pool->objectSize);
+		for (i = pool->objectsPerChunk - 1; i >= 0; i--)
+		{
+			*(void **) (chunk + i * pool->objectSize) = pool->freeList;
+			pool->freeList = chunk + i * pool->objectSize;
+		}
+	}
+
+	returnValue = pool->freeList;
+	pool->freeList = *(void **) returnValue;
+	memset(returnValue, 0, pool->objectSize);
+
+	return returnValue;
+}
+
+void sPoolFree(struct sPool * pool, void * object)
+{
+	*(void **) object = pool->freeList;
+	pool->freeList = object;
+}
@@ -14,5 +14,19 @@ int safeSend(int socketNum, uint8_t * buffer, int bufferLen, int flag);
 void * srealloc(void *ptr, size_t size);
 void * sCalloc(size_t nmemb, size_t size);
 
+// Fixed-size object pool.  Objects are carved out of contiguous chunks
+// and recycled through a free list, so once the pool has grown large
+// enough, sPoolAlloc()/sPoolFree() never call malloc() or free().
+// Chunks are kept for the life of the program.
+struct sPool {
+	size_t objectSize;      // rounded up to keep every object aligned
+	int objectsPerChunk;
+	void * freeList;        // free objects, linked through their first bytes
+};
+
+void sPoolInit(struct sPool * pool, size_t objectSize, int objectsPerChunk);
+void * sPoolAlloc(struct sPool * pool);    // zero-filled, like sCalloc()
+void sPoolFree(struct sPool * pool, void * object);
+
 
 #endif
\ No newline at end of file
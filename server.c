@@ -3,19 +3,40 @@
  *
  * Chat server program.
  *
- * Usage: chatServer [optional port-number]
+ * Usage: chatServer [-v] [-e event-log-file] [-m metrics-port] [optional port-number]
+ *        -v  verbose: log every message relayed (debug level, off by default)
+ *        -e  record accepts, registrations, relays, errors and disconnects in a binary
+ *            event log (see eventLog.h; decode it with chatlogdump)
+ *        -m  serve the metrics at http://127.0.0.1:metrics-port/metrics in the Prometheus
+ *            text format (see metricsHttp.h; 0 picks a free port, which is logged)
  *
  * This server:
- *  - Uses poll() (via pollLib) to accept new connections and process
- *    data from connected clients.
+ *  - Uses poll()/epoll() (via pollLib) to accept new connections and process
+ *    data from connected clients, servicing every ready socket per wakeup.
  *  - Processes client packets:
- *      • Registration (flag=1): check for duplicate handle and add to table.
+ *      • Registration (flag=1): check for duplicate handle, add to table and ack with the client's id.
  *      • Message (flag=5): forward %M messages.
  *      • Broadcast (flag=4): forward %B messages.
  *      • Multicast (flag=6): forward %C messages (and send error packets with flag=7 for each invalid dest).
+ *      • Message and multicast by id (flag=8, flag=9): the same, the destinations named by their 32-bit ids
+ *        (each resolved with one array access), with a flag=17 error for each id not registered.
  *      • List request (flag=10): send a flag=11 packet (with count), then one flag=12 per handle, then flag=13.
+ *        A client that sets LIST_PACKED in the optional options byte gets the handles packed into as few
+ *        flag=15 packets as fit instead of one flag=12 each, and with LIST_IDS each handle's id after it.
+ *      • Prefix list request (flag=14): the same response, holding only the handles that start with a
+ *        given prefix, at most a given number of them.
+ *      • Paged list request (flag=16): one page of the sorted handles after a cursor, the flag=13 packet
+ *        carrying the cursor for the next page.
+ *      • Presence subscription (flag=18): a versioned snapshot of the handles (flag=19, then a list
+ *        response), then a flag=20 (join) or flag=21 (leave) delta for every change that follows.
+ *  - Never blocks on a client: sockets are non-blocking, output a client cannot take yet waits
+ *    in its own queue (sent when poll reports POLLOUT), and a client that lets that queue grow
+ *    past OUTBOUND_LIMIT is dropped, so a slow reader only ever delays itself.
  *
  * Client–handle/state information is stored in a separate “handle table” module.
+ * Diagnostics go through the asynchronous logger (log.h), never straight to stdout, and
+ * traffic, handler times and fan-out widths are counted in the metrics registry (metrics.h),
+ * which the optional metrics listener serves from the same poll loop.
  *
  * Author: Robin Simpson
  * Lab Section: 3pm
@@ -25,181 +46,627 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>        // For getopt()
+#include <errno.h>         // For EAGAIN (fan-out send results)
+#include <signal.h>        // For sigaction() (SIGINT/SIGTERM shutdown)
 #include <arpa/inet.h>     // For inet_ntop()
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include "pdu.h"           // Protocol Data Unit functions
 #include "networks.h"      // Networking setup and helper functions
 #include "pollLib.h"       // Polling functionality for multiple sockets
+#include "safeUtil.h"      // srealloc()
 #include "handleTable.h"   // Data structure for mapping client handles to sockets
+#include "log.h"           // LOG_INFO() and friends
+#include "eventLog.h"      // eventLogRecord()
+#include "metrics.h"       // metricAdd(), metricObserve()
+#include "metricsHttp.h"   // metricsHttpOpen(), metricsHttpService()
 
-#define MAXBUF    1400    // Maximum buffer size for receiving data
 #define MAX_HANDLE 100    // Maximum allowed length for a client handle
+#define PDU_BUDGET 8      // Maximum PDUs served per connection per pass of the main loop
+#define OUTBOUND_LIMIT (1024 * 1024)  // Bytes queued for one client before it is dropped as too slow
+
+/* List request options byte */
+#define LIST_PACKED 0x01  // Answer with packed flag=15 packets instead of one flag=12 per handle
+#define LIST_IDS    0x02  // Follow each handle listed (or in a presence delta) with its 4-byte id
+
+#define LIST_PAGE_MAX 1000  // Most handles sent in one page of a paged list request
+
+/*
+ * Clients that used up their PDU_BUDGET with data possibly still buffered in their
+ * decoder. poll cannot see those bytes, so they are serviced on the next pass.
+ */
+static int *backlog = NULL;
+static int backlogCount = 0;
+static int backlogSize = 0;
+
+/*
+ * Number of the current pass of the main loop. A client serviced in a pass (from the
+ * backlog or because its socket was ready) is not serviced again in the same pass.
+ */
+static unsigned int passNumber = 0;
+
+/*
+ * Clients that failed while another client's packet was being handled. Closing
+ * them right away could pull them out from under a fan-out in progress, so they
+ * are closed by closeFailedClients() once it is done.
+ */
+static int *failedList = NULL;
+static int failedCount = 0;
+static int failedSize = 0;
+
+/*
+ * Sends collected while a packet is handled (every relay and presence delta), made
+ * together by flushFanout(): one pollSendBatch() covers the whole fan-out, which on the
+ * io_uring backend is a single io_uring_enter() however many recipients there are.
+ * Each entry holds a reference to its frame, or points at the received frame in the
+ * read buffer, which stays valid until the next packet is decoded.
+ */
+struct fanoutEntry {
+    int sock;
+    const uint8_t *bytes;       // header + payload of the PDU(s) to send
+    int length;
+    struct pduFrame *frame;     // frame holding 'bytes', NULL for a received frame
+    int send;                   // index in fanoutSends, -1 if it is only queued
+};
+static struct fanoutEntry *fanout = NULL;
+static struct pollSend *fanoutSends = NULL;
+static int fanoutCount = 0;
+static int fanoutSize = 0;
+
+/*
+ * The complete %L response (count, the handles, end marker) encoded back to back in one
+ * shared frame, indexed by its LIST_PACKED and LIST_IDS options. Each is rebuilt only on the
+ * first request for it after a join or leave; until then every request just queues
+ * another reference to it.
+ */
+static struct pduFrame *listResponse[4] = { NULL, NULL, NULL, NULL };
+static unsigned int listResponseVersion[4] = { 0, 0, 0, 0 };
+
+/*
+ * Clients subscribed to presence deltas, packed (each records its position, so
+ * unsubscribing swaps the last one into the hole). A join or leave is framed once and
+ * that frame queued for each of them.
+ */
+static int *subscribers = NULL;
+static int subscriberCount = 0;
+static int subscriberSize = 0;
+
+/*
+ * Set by SIGINT and SIGTERM. The main loop finishes its pass and main() returns, so the
+ * atexit handlers still write out the buffered event log records and queued log lines.
+ */
+static volatile sig_atomic_t stopRequested = 0;
 
 
 /*
  * This function returns a string that identifies the client connected on the socket 'sock'.
  * If the client has registered a handle (username), that handle is returned along with the socket number.
  * Otherwise, it returns a string containing the client's IP address and port number along with the socket number.
+ * The address is the one cached in the client's record at accept time, so no system call is made.
  * The returned string is stored in a static buffer and should be used immediately.
  */
 const char *getClientIdentifier(int sock) {
     static char idStr[256];  // Static buffer to hold the identifier string
-    char *handle = lookupHandleBySocket(sock); // Look up the registered handle for this socket
+    struct ClientEntry *client = lookupConnection(sock);
 
-    if (handle != NULL) {
+    if (client == NULL) {
+        snprintf(idStr, sizeof(idStr), "socket %d", sock);
+    } else if (client->handle != NULL) {
         // If a handle exists, format the identifier with the handle and the socket number
-        snprintf(idStr, sizeof(idStr), "%s (socket %d)", handle, sock);
+        snprintf(idStr, sizeof(idStr), "%s (socket %d)", client->handle, sock);
     } else {
-        // Otherwise, retrieve the client's IP and port using getpeername
-        struct sockaddr_storage addr;
-        socklen_t addr_len = sizeof(addr);
-        char ipStr[INET6_ADDRSTRLEN] = "(unknown)";
-        int port = 0;
-        
-        // Try to get the peer address for the socket
-        if (getpeername(sock, (struct sockaddr *)&addr, &addr_len) == 0) {
-            if (addr.ss_family == AF_INET6) {
-                struct sockaddr_in6 *s = (struct sockaddr_in6 *)&addr;
-                inet_ntop(AF_INET6, &s->sin6_addr, ipStr, sizeof(ipStr));
-                port = ntohs(s->sin6_port);
-            } else if (addr.ss_family == AF_INET) {
-                struct sockaddr_in *s = (struct sockaddr_in *)&addr;
-                inet_ntop(AF_INET, &s->sin_addr, ipStr, sizeof(ipStr));
-                port = ntohs(s->sin_port);
-            }
-        }
         // Format the identifier using the IP address, port, and socket number
-        snprintf(idStr, sizeof(idStr), "%s:%d (socket %d)", ipStr, port, sock);
+        snprintf(idStr, sizeof(idStr), "%s:%d (socket %d)", client->peerIP, client->peerPort, sock);
     }
     return idStr;
 }
 
-/*
- * This function fills the provided buffer 'ipBuf' with the client's IP address and sets the integer pointed to by 'port'
- * to the client's port number. It uses the socket 'sock' to determine the peer's address using getpeername.
- */
-void getIPAndPort(int sock, char *ipBuf, int bufLen, int *port) {
-    struct sockaddr_storage addr;  // Generic socket address storage
-    socklen_t addr_len = sizeof(addr);  // Size of the address structure
-    
-    // Retrieve the address of the peer connected to the socket
-    if (getpeername(sock, (struct sockaddr *)&addr, &addr_len) == 0) {
-        // Check if the address is IPv6
-        if (addr.ss_family == AF_INET6) {
-            struct sockaddr_in6 *s = (struct sockaddr_in6 *)&addr;
-            // Convert the IPv6 address to a human-readable format and store it in ipBuf
-            inet_ntop(AF_INET6, &s->sin6_addr, ipBuf, bufLen);
-            // Convert the port number from network byte order to host byte order
-            *port = ntohs(s->sin6_port);
-        } else if (addr.ss_family == AF_INET) {
-            struct sockaddr_in *s = (struct sockaddr_in *)&addr;
-            // Convert the IPv4 address to a human-readable format and store it in ipBuf
-            inet_ntop(AF_INET, &s->sin_addr, ipBuf, bufLen);
-            // Convert the port number from network byte order to host byte order
-            *port = ntohs(s->sin_port);
-        }
-    } else {
-        // If getpeername fails, set ipBuf to "(unknown)" and port to 0
-        strncpy(ipBuf, "(unknown)", bufLen);
-        *port = 0;
-    }
-}
-
 
 /* Function prototypes for processing different packet types */
+void openClient(int sock, const struct sockaddr_in6 *peer);
+void closeClient(int sock);
+void serviceBacklog();
+void sendToClient(int sock, const struct iovec *parts, int partCount);
+void forwardFrame(int sock, const uint8_t *frameBytes);
+void sendFrameToClient(int sock, struct pduFrame *frame);
+void queueFanout(int sock, const uint8_t *bytes, int length, struct pduFrame *frame);
+void flushFanout();
+void checkOutbound(int sock, int ret);
+void failClient(int sock, const char *reason);
+void closeFailedClients();
+void flushClient(int sock);
 void processClientSocket(int sock);
+void processPacket(int sock, uint8_t *buf, int len);
 void processRegistration(int sock, uint8_t *buffer, int len);
 void processBroadcast(int sock, uint8_t *buffer, int len);
 void processMessage(int sock, uint8_t *buffer, int len);
 void processMulticast(int sock, uint8_t *buffer, int len);
+void processIdMessage(int sock, uint8_t *buffer, int len);
 void processListRequest(int sock, uint8_t *buffer, int len);
+void processPrefixListRequest(int sock, uint8_t *buffer, int len);
+void processPagedListRequest(int sock, uint8_t *buffer, int len);
+struct pduFrame *buildListResponse(char *const *handles, const uint32_t *ids, unsigned int count, int packed,
+                                   const char *next);
+void processPresenceRequest(int sock, uint8_t *buffer, int len);
+void unsubscribePresence(int sock);
+void publishPresence(uint8_t flag, const char *handle, uint32_t id);
 void sendErrorPacket(int sock, const char *destHandle);
+void sendIdErrorPacket(int sock, uint32_t destId);
+int collectGauges(struct metricGauge *gauges, int max);
+void requestStop(int signalNumber);
 
 int main(int argc, char *argv[]) {
     int port = 0;  // Default port (0 means that tcpServerSetup() may choose a random available port)
+    int level = LOG_LEVEL_INFO;
+    int metricsPort = -1;  // -1: no metrics listener
+    int opt;
 
-    /* Check if the command line arguments are valid.
-       If more than one argument (besides the program name) is provided, display usage and exit. */
-    if (argc > 2) {
-        fprintf(stderr, "Usage: %s [optional port number]\n", argv[0]);
+    /* Check if the command line arguments are valid: options, then at most one
+       argument (the port). Otherwise, display usage and exit. */
+    while ((opt = getopt(argc, argv, "ve:m:")) != -1) {
+        if (opt == 'v') {
+            level = LOG_LEVEL_DEBUG;
+        } else if (opt == 'e') {
+            eventLogOpen(optarg);
+        } else if (opt == 'm') {
+            metricsPort = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-v] [-e event-log-file] [-m metrics-port] [optional port number]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind > 1) {
+        fprintf(stderr, "Usage: %s [-v] [-e event-log-file] [-m metrics-port] [optional port number]\n", argv[0]);
         exit(1);
     }
     /* If a port number is provided, convert it from string to integer. */
-    if (argc == 2)
-        port = atoi(argv[1]);
+    if (argc - optind == 1)
+        port = atoi(argv[optind]);
 
     /* Set up the listening TCP socket. tcpServerSetup() binds and listens on the given port.
        If port==0, the system assigns an ephemeral port. */
     int listenSock = tcpServerSetup(port);
 
+    /* From here on the server only logs through the logger's writer thread. */
+    logInit(level);
+
+    /* SIGINT and SIGTERM only ask the main loop to stop. Without SA_RESTART the signal also
+       ends a blocking pollCallMany(), which then returns no events. */
+    struct sigaction stop;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = requestStop;
+    sigemptyset(&stop.sa_mask);
+    if (sigaction(SIGINT, &stop, NULL) < 0 || sigaction(SIGTERM, &stop, NULL) < 0) {
+        perror("sigaction");
+        exit(-1);
+    }
+
     /* Initialize the poll set and add the listening socket to it.
        The poll set will be used to check for activity on multiple sockets concurrently. */
     setupPollSet();
-    addToPollSet(listenSock);
+    addListenerToPollSet(listenSock);
+    if (metricsPort >= 0)
+        metricsHttpOpen(metricsPort, collectGauges);
 
     /* Initialize the handle table that maps client handles (usernames) to their socket descriptors.
        This is used to track client registrations and route messages. */
     initHandleTable();
 
-    /* Main program loop: runs indefinitely, handling incoming connections and client messages */
-    while (1) {
-        /* pollCall() blocks until there is activity on one of the sockets.
-           It returns the socket descriptor that is ready for I/O. */
-        int ready = pollCall(-1);
-
-        /* If the ready socket is the listening socket, then a new client is trying to connect */
-        if (ready == listenSock) {
-            /* Accept the new client connection. The second parameter is a timeout (0 for blocking accept).
-               We pass a debug flag of 1 so that tcpAccept() prints out the client's IP and port. */
-            int clientSock = tcpAccept(listenSock, 1);
-            /* Do not print the accepted connection details here because the client name is not known yet.
-               The accepted connection details will be printed after registration. */
-            addToPollSet(clientSock);
-        } else {
-            /* Otherwise, the ready socket belongs to an already-connected client.
-               Process the incoming data from that client. */
-            processClientSocket(ready);
+    /* Main program loop: runs until SIGINT or SIGTERM, handling incoming connections and client messages */
+    struct pollReady readyList[POLL_EVENT_BATCH];
+    while (!stopRequested) {
+        /* pollCallMany() blocks until there is activity on at least one of the sockets.
+           It fills readyList with every socket that is ready, so one call services the whole batch.
+           If clients are waiting on the backlog it only checks, without blocking, and while
+           event log records are buffered it wakes up in time to write them out. */
+        int timeout = backlogCount > 0 ? 0 : eventLogPending() ? EVENT_FLUSH_MS : POLL_WAIT_FOREVER;
+        int readyCount = pollCallMany(timeout, readyList, POLL_EVENT_BATCH);
+        eventLogTick();
+        passNumber++;
+
+        /* Clients left over from the previous pass get their next turn first */
+        serviceBacklog();
+        closeFailedClients();
+
+        for (int i = 0; i < readyCount; i++) {
+            int ready = readyList[i].fd;
+            short revents = readyList[i].revents;
+
+            /* If the ready socket is the listening socket, then a new client is trying to connect */
+            if (ready == listenSock) {
+                /* Accept every new client connection waiting, keeping its address for later
+                   log messages (openClient() logs it). */
+                struct sockaddr_in6 peer;
+                socklen_t peerLength = sizeof(peer);
+                int clientSock;
+                while ((clientSock = pollAccept(listenSock, (struct sockaddr *) &peer, &peerLength)) >= 0) {
+                    openClient(clientSock, &peer);
+                    peerLength = sizeof(peer);
+                }
+            } else if (lookupConnection(ready) != NULL) {
+                /* Otherwise, the ready socket belongs to an already-connected client (unless it was
+                   closed earlier in this batch). If it can take more output, send what is queued;
+                   then process the incoming data from that client, up to its per-pass budget.
+                   A client that already had its turn in this pass (from the backlog: its socket
+                   still reports the bytes left in the kernel) waits for the next one. */
+                if (revents & POLLOUT)
+                    flushClient(ready);
+                struct ClientEntry *client = lookupConnection(ready);
+                if ((revents & ~POLLOUT) && client != NULL && client->servicedPass != passNumber)
+                    processClientSocket(ready);
+            } else {
+                /* Not a chat socket: the metrics listener or one of its scrapes (or a socket
+                   closed earlier in this batch, which it ignores) */
+                metricsHttpService(ready, revents);
+            }
         }
+        closeFailedClients();
     }
+    LOG_INFO("Shutting down.");
     return 0;
 }
 
 /*
- * processClientSocket:
- *   Reads data from a client socket and processes the packet based on its flag.
- *   If the client disconnects (recvPDU returns <= 0), removes the client from the poll set
- *   and from the handle table.
+ * Signal handler for SIGINT and SIGTERM: flags the main loop to stop. A signal that lands
+ * just before the loop blocks is seen at its next wakeup.
  */
-void processClientSocket(int sock) {
-    uint8_t buf[MAXBUF];  // Buffer to hold the incoming data
-    int len = recvPDU(sock, buf, MAXBUF);
-    if (len <= 0) {
-        /* If len is <= 0, either the client has closed the connection or an error occurred.
-           Retrieve the client's handle (if registered) for logging purposes,
-           then remove the client's information from the handle table and poll set. */
-        char *handle = lookupHandleBySocket(sock);
-        if (handle != NULL)
-            printf("\n[INFO] Client %s disconnected.\n", handle);
-        else
-            printf("\n[INFO] Client on socket %d disconnected.\n", sock);
+void requestStop(int signalNumber) {
+    (void) signalNumber;
+    stopRequested = 1;
+}
+
+/*
+ * openClient:
+ *   Sets up the receive and send state for a newly accepted client, records its address
+ *   (formatted once here, for every log message about it later) and adds its socket to
+ *   the poll set. pollAccept() made the socket non-blocking already (a client that stops
+ *   reading must never stall the server).
+ */
+void openClient(int sock, const struct sockaddr_in6 *peer) {
+    struct ClientEntry *client = addConnection(sock);
+    if (inet_ntop(AF_INET6, &peer->sin6_addr, client->peerIP, sizeof(client->peerIP)) == NULL)
+        strcpy(client->peerIP, "(unknown)");
+    client->peerPort = ntohs(peer->sin6_port);
+    LOG_INFO("Client accepted.  Client IP: %s Client Port Number: %d", client->peerIP, client->peerPort);
+    eventLogRecord(EVENT_ACCEPT, sock, 0, 0, 0);
+    metricAdd(metricCounters[METRIC_ACCEPTS], 1);
+    pduDecoderInit(&client->decoder);
+    pduQueueInit(&client->outbound);
+    addToPollSet(sock);
+}
+
+/*
+ * closeClient:
+ *   Frees the client's receive state and any frames still queued for it, removes its
+ *   record from the handle table and its socket from the poll set, and closes the socket.
+ *   If the client had registered, presence subscribers are told it left.
+ */
+void closeClient(int sock) {
+    struct ClientEntry *client = lookupConnection(sock);
+    pduDecoderRelease(&client->decoder);
+    pduQueueClear(&client->outbound);
+    eventLogRecord(EVENT_DISCONNECT, sock, client->id, 0, 0);
+    metricAdd(metricCounters[METRIC_DISCONNECTS], 1);
+    unsubscribePresence(sock);
+    if (client->handle != NULL) {
+        /* The handle string goes back to the pool with the registration */
+        char handle[MAX_HANDLE+1];
+        uint32_t id = client->id;
+        strcpy(handle, client->handle);
         removeHandleBySocket(sock);
-        removeFromPollSet(sock);
-        close(sock);
+        publishPresence(21, handle, id);
+    }
+    removeConnection(sock);
+    removeFromPollSet(sock);
+    close(sock);
+}
+
+/*
+ * serviceBacklog:
+ *   Gives every client on the backlog its next turn. Clients that use up their
+ *   budget again are put back on it for the following pass.
+ */
+void serviceBacklog() {
+    int count = backlogCount;
+
+    for (int i = 0; i < count; i++) {
+        int sock = backlog[i];
+        /* Skip clients closed since (a reused socket number starts with backlogged == 0) */
+        struct ClientEntry *client = lookupConnection(sock);
+        if (client != NULL && client->backlogged) {
+            client->backlogged = 0;
+            processClientSocket(sock);   /* may append the client again, behind 'count' */
+        }
+    }
+
+    /* Keep only the clients appended during this pass */
+    backlogCount -= count;
+    if (backlogCount > 0)
+        memmove(backlog, backlog + count, backlogCount * sizeof(int));
+}
+
+/*
+ * sendToClient:
+ *   Sends a packet built by the server (payload given as pieces) to a client, queueing
+ *   whatever its socket cannot take right away. Fan-out sends still waiting for the
+ *   client are made first, so it gets its packets in order.
+ */
+void sendToClient(int sock, const struct iovec *parts, int partCount) {
+    struct ClientEntry *client = lookupConnection(sock);
+    if (client->fanoutPending)
+        flushFanout();
+    if (client->failed)
         return;
+    int bytes = PDU_HEADER_LEN;
+    for (int i = 0; i < partCount; i++)
+        bytes += parts[i].iov_len;
+    metricAdd(metricPdusOut[metricFlag(((const uint8_t *) parts[0].iov_base)[0])], 1);
+    metricAdd(metricCounters[METRIC_BYTES_OUT], bytes);
+    checkOutbound(sock, pduQueueSendv(&client->outbound, sock, parts, partCount));
+}
+
+/*
+ * forwardFrame:
+ *   Passes a received frame on to a client exactly as it arrived, as part of the current
+ *   fan-out (see flushFanout()). The frame is only copied if some recipient cannot take
+ *   all of it right away, and then once for all of them.
+ */
+void forwardFrame(int sock, const uint8_t *frameBytes) {
+    struct ClientEntry *client = lookupConnection(sock);
+    if (client->failed)
+        return;
+    int length = (frameBytes[0] << 8) | frameBytes[1];
+    metricAdd(metricPdusOut[metricFlag(frameBytes[PDU_HEADER_LEN])], 1);
+    metricAdd(metricCounters[METRIC_BYTES_OUT], length);
+    queueFanout(sock, frameBytes, length, NULL);
+}
+
+/*
+ * sendFrameToClient:
+ *   Sends a frame the server keeps (e.g. the cached list response) to a client, as part
+ *   of the current fan-out. If the socket cannot take all of it, the client's queue holds
+ *   a reference, not a copy.
+ */
+void sendFrameToClient(int sock, struct pduFrame *frame) {
+    struct ClientEntry *client = lookupConnection(sock);
+    if (client->failed)
+        return;
+    metricAdd(metricPdusOut[metricFlag(frame->bytes[PDU_HEADER_LEN])], 1);
+    metricAdd(metricCounters[METRIC_BYTES_OUT], frame->length);
+    queueFanout(sock, frame->bytes, frame->length, pduFrameRetain(frame));
+}
+
+/*
+ * queueFanout:
+ *   Adds a send to the current fan-out. A client gets at most one send per fan-out (the
+ *   sends of a batch may go out in any order), so a second one flushes the first.
+ */
+void queueFanout(int sock, const uint8_t *bytes, int length, struct pduFrame *frame) {
+    struct ClientEntry *client = lookupConnection(sock);
+
+    if (client->fanoutPending)
+        flushFanout();
+    if (fanoutCount == fanoutSize) {
+        fanoutSize = fanoutSize ? fanoutSize * 2 : 64;
+        fanout = srealloc(fanout, fanoutSize * sizeof(struct fanoutEntry));
+        fanoutSends = srealloc(fanoutSends, fanoutSize * sizeof(struct pollSend));
     }
+    fanout[fanoutCount].sock = sock;
+    fanout[fanoutCount].bytes = bytes;
+    fanout[fanoutCount].length = length;
+    fanout[fanoutCount].frame = frame;
+    fanoutCount++;
+    client->fanoutPending = 1;
+}
+
+/*
+ * flushFanout:
+ *   Makes the sends of the current fan-out. Clients with nothing queued get theirs in one
+ *   pollSendBatch(); the others have it queued behind what they are still waiting for.
+ *   Whatever a socket did not take is queued (a received frame copied once, shared by
+ *   every recipient that needs it) and each client is followed up as for a direct send.
+ */
+void flushFanout() {
+    int sendCount = 0;
+
+    for (int i = 0; i < fanoutCount; i++) {
+        struct fanoutEntry *entry = &fanout[i];
+        struct ClientEntry *client = lookupConnection(entry->sock);
+        entry->send = -1;
+        if (client == NULL || client->failed || client->outbound.head != NULL)
+            continue;
+        entry->send = sendCount;
+        fanoutSends[sendCount].fd = entry->sock;
+        fanoutSends[sendCount].bytes = entry->bytes;
+        fanoutSends[sendCount].length = entry->length;
+        sendCount++;
+    }
+    pollSendBatch(fanoutSends, sendCount);
+
+    const uint8_t *sharedBytes = NULL;
+    struct pduFrame *shared = NULL;
+    for (int i = 0; i < fanoutCount; i++) {
+        struct fanoutEntry *entry = &fanout[i];
+        struct ClientEntry *client = lookupConnection(entry->sock);
+        if (client != NULL) {
+            client->fanoutPending = 0;
+            if (!client->failed) {
+                int bytesSent = 0;
+                if (entry->send >= 0) {
+                    int result = fanoutSends[entry->send].result;
+                    bytesSent = result >= 0 ? result : (result == -EAGAIN || result == -EWOULDBLOCK) ? 0 : -1;
+                }
+                struct pduFrame **frame = &entry->frame;
+                if (entry->frame == NULL) {
+                    /* The copy of a received frame is shared by its recipients */
+                    if (entry->bytes != sharedBytes) {
+                        if (shared != NULL)
+                            pduFrameRelease(shared);
+                        shared = NULL;
+                        sharedBytes = entry->bytes;
+                    }
+                    frame = &shared;
+                }
+                checkOutbound(entry->sock, pduQueueSent(&client->outbound, entry->bytes, entry->length,
+                                                        bytesSent, frame));
+            }
+        }
+        if (entry->frame != NULL)
+            pduFrameRelease(entry->frame);
+    }
+    if (shared != NULL)
+        pduFrameRelease(shared);
+    fanoutCount = 0;
+}
+
+/*
+ * checkOutbound:
+ *   Follows up on a send to a client. If output was queued, POLLOUT is watched until the
+ *   queue drains. A client whose send failed, or whose queue has grown past OUTBOUND_LIMIT
+ *   because it is not reading, is failed; every other client carries on unaffected.
+ */
+void checkOutbound(int sock, int ret) {
+    struct ClientEntry *client = lookupConnection(sock);
+
+    if (ret < 0) {
+        failClient(sock, "send failed");
+    } else if (client->outbound.pending > OUTBOUND_LIMIT) {
+        failClient(sock, "not reading, outbound queue full");
+    } else if (ret == 1 && !client->writeInterest) {
+        setPollWriteInterest(sock, 1);
+        client->writeInterest = 1;
+    }
+}
+
+/*
+ * failClient:
+ *   Stops all output to the client and lists it for closeFailedClients().
+ */
+void failClient(int sock, const char *reason) {
+    LOG_WARN("Dropping %s: %s.", getClientIdentifier(sock), reason);
+    struct ClientEntry *client = lookupConnection(sock);
+    client->failed = 1;
+    pduQueueClear(&client->outbound);
+    metricAdd(metricCounters[METRIC_DROPS], 1);
+    if (failedCount == failedSize) {
+        failedSize = failedSize ? failedSize * 2 : 64;
+        failedList = srealloc(failedList, failedSize * sizeof(int));
+    }
+    failedList[failedCount++] = sock;
+}
+
+/*
+ * closeFailedClients:
+ *   Closes the clients failed since the last call.
+ */
+void closeFailedClients() {
+    for (int i = 0; i < failedCount; i++) {
+        int sock = failedList[i];
+        /* A client may already be closed (its own read saw the disconnect) */
+        struct ClientEntry *client = lookupConnection(sock);
+        if (client != NULL && client->failed)
+            closeClient(sock);
+    }
+    failedCount = 0;
+}
+
+/*
+ * flushClient:
+ *   The client's socket can take more output: send what is queued for it. Once the
+ *   queue is empty POLLOUT is no longer watched.
+ */
+void flushClient(int sock) {
+    struct ClientEntry *client = lookupConnection(sock);
+
+    if (client->failed)
+        return;
+    int ret = pduQueueFlush(&client->outbound, sock);
+    if (ret < 0) {
+        LOG_INFO("Client %s disconnected.", getClientIdentifier(sock));
+        closeClient(sock);
+    } else if (ret == 0 && client->writeInterest) {
+        setPollWriteInterest(sock, 0);
+        client->writeInterest = 0;
+    }
+}
+
+/*
+ * processClientSocket:
+ *   Reads whatever the client has sent without blocking (up to PDU_READ_SIZE bytes per
+ *   recv()) and processes each complete packet based on its flag. A client that stops
+ *   halfway through a PDU keeps its partial frame in its decoder and is resumed the next
+ *   time its socket is ready.
+ *
+ *   At most PDU_BUDGET packets are handled per call. A client that uses up its budget
+ *   goes on the backlog and gets its next turn on the following pass, after every other
+ *   ready socket has had its turn, so a chatty client cannot starve the rest. Either way a
+ *   client gets at most one call per pass of the main loop.
+ *
+ *   If the client disconnects or sends an invalid frame, it is closed.
+ */
+void processClientSocket(int sock) {
+    struct ClientEntry *client = lookupConnection(sock);
+
+    client->servicedPass = passNumber;
+    for (int budget = PDU_BUDGET; budget > 0; budget--) {
+        uint8_t *buf;
+        int len = pduDecode(&client->decoder, sock, &buf);
+        if (len == 0)
+            return;  /* Partial PDU: wait until the socket is ready again */
+
+        if (len < 0) {
+            /* Either the client has closed the connection, an error occurred or the frame was invalid.
+               Retrieve the client's handle (if registered) for logging purposes, then close it. */
+            if (len == PDU_BAD_FRAME)
+                LOG_WARN("%s sent an invalid PDU length.", getClientIdentifier(sock));
+            char *handle = lookupHandleBySocket(sock);
+            if (handle != NULL)
+                LOG_INFO("Client %s disconnected.", handle);
+            else
+                LOG_INFO("Client on socket %d disconnected.", sock);
+            closeClient(sock);
+            return;
+        }
+
+        processPacket(sock, buf, len);
+
+        /* The handler may have closed the client (e.g. rejected registration) */
+        if ((client = lookupConnection(sock)) == NULL)
+            return;
+    }
+
+    /* Budget used up: more PDUs may already be buffered, come back next pass */
+    if (!client->backlogged) {
+        if (backlogCount == backlogSize) {
+            backlogSize = backlogSize ? backlogSize * 2 : 64;
+            backlog = srealloc(backlog, backlogSize * sizeof(int));
+        }
+        backlog[backlogCount++] = sock;
+        client->backlogged = 1;
+    }
+}
 
+/*
+ * processPacket:
+ *   Dispatches one complete packet from a client based on its flag, counting it and
+ *   timing its handler in the metrics.
+ */
+void processPacket(int sock, uint8_t *buf, int len) {
     /* The first byte of the packet is the flag indicating the type of message. */
     uint8_t flag = buf[0];
+    uint64_t start = metricNow();
+    metricAdd(metricPdusIn[metricFlag(flag)], 1);
+    metricAdd(metricCounters[METRIC_BYTES_IN], PDU_HEADER_LEN + len);
     switch (flag) {
         case 1:
             /* Registration packet: client wants to register a handle. */
-            // printf("[INFO] %s is attempting registration.\n", getClientIdentifier(sock));
+            // LOG_INFO("%s is attempting registration.", getClientIdentifier(sock));
             processRegistration(sock, buf, len);
             break;
         case 4:
             /* Broadcast packet: client is sending a message to all other clients. */
-            // printf("[INFO] %s is broadcasting a message.\n", getClientIdentifier(sock));
+            // LOG_INFO("%s is broadcasting a message.", getClientIdentifier(sock));
             processBroadcast(sock, buf, len);
             break;
         case 5:
@@ -208,19 +675,40 @@ void processClientSocket(int sock) {
             break;
         case 6:
             /* Multicast packet: message intended for multiple recipients. */
-            // printf("[INFO] %s is sending a multicast message.\n", getClientIdentifier(sock));
+            // LOG_INFO("%s is sending a multicast message.", getClientIdentifier(sock));
             processMulticast(sock, buf, len);
             break;
+        case 8:
+        case 9:
+            /* Message or multicast packet addressed by client id instead of handle. */
+            processIdMessage(sock, buf, len);
+            break;
         case 10:
             /* List request packet: client is requesting a list of all registered handles. */
-            printf("\n[INFO] %s is requesting the client list.\n", getClientIdentifier(sock));
+            LOG_INFO("%s is requesting the client list.", getClientIdentifier(sock));
             processListRequest(sock, buf, len);
             break;
+        case 14:
+            /* Prefix list request packet: client wants the registered handles starting with a prefix. */
+            LOG_INFO("%s is requesting a filtered client list.", getClientIdentifier(sock));
+            processPrefixListRequest(sock, buf, len);
+            break;
+        case 16:
+            /* Paged list request packet: client wants the next page of registered handles. */
+            processPagedListRequest(sock, buf, len);
+            break;
+        case 18:
+            /* Presence packet: client subscribes to (or unsubscribes from) join/leave deltas. */
+            processPresenceRequest(sock, buf, len);
+            break;
         default:
             /* For any unknown flag, the server simply ignores the packet. */
-            printf("[WARN] Unknown flag %d from %s. Packet ignored.\n", flag, getClientIdentifier(sock));
+            LOG_WARN("Unknown flag %d from %s. Packet ignored.", flag, getClientIdentifier(sock));
             break;
     }
+    /* Everything the handler sent goes out now, while the received frame is still valid */
+    flushFanout();
+    metricObserve(&metricHandlerNs[metricFlag(flag)], metricNow() - start);
 }
 
 /*
@@ -230,10 +718,11 @@ void processClientSocket(int sock) {
  *
  *   The function checks:
  *     - That the packet length is sufficient.
- *     - That the handle does not exceed the maximum allowed length.
+ *     - That the handle is not empty and does not exceed the maximum allowed length.
  *     - That the handle is not already registered (i.e., no duplicate).
- *   It sends back an error (flag=3) if the handle is too long or a duplicate.
- *   Otherwise, it adds the handle to the table and sends a confirmation (flag=2).
+ *   It sends back an error (flag=3) if the handle is empty, too long or a duplicate.
+ *   Otherwise, it adds the handle to the table and sends a confirmation (flag=2) carrying
+ *   the 32-bit id the table assigned to the client: [flag=2][id (4 bytes, network order)].
  */
 void processRegistration(int sock, uint8_t *buffer, int len) {
     /* Check that the packet has at least 2 bytes (flag and handle length) */
@@ -244,13 +733,15 @@ void processRegistration(int sock, uint8_t *buffer, int len) {
     if (len < 2 + hlen) return;
     char handle[MAX_HANDLE+1];  // Buffer to store the handle; +1 for the null terminator
 
-    /* If the handle length exceeds the maximum allowed length, send an error and close the connection */
-    if (hlen > MAX_HANDLE) {
-        uint8_t resp = 3; // Error code for "handle too long" or duplicate handle error
-        sendPDU(sock, &resp, 1);
-        printf("[WARN] %s attempted registration with a too-long handle.\n", getClientIdentifier(sock));
-        close(sock);
-        removeFromPollSet(sock);
+    /* If the handle is empty or longer than allowed, send an error and close the connection */
+    if (hlen == 0 || hlen > MAX_HANDLE) {
+        uint8_t resp = 3; // Error code for "handle empty or too long" or duplicate handle error
+        struct iovec part = { &resp, 1 };
+        sendToClient(sock, &part, 1);
+        LOG_WARN("%s attempted registration with %s handle.", getClientIdentifier(sock),
+                 hlen == 0 ? "an empty" : "a too-long");
+        metricAdd(metricCounters[METRIC_REGISTRATION_REJECTS], 1);
+        closeClient(sock);
         return;
     }
     /* Copy the handle from the packet and ensure it is null-terminated */
@@ -260,25 +751,48 @@ void processRegistration(int sock, uint8_t *buffer, int len) {
     /* Check if the handle is already in use by another client */
     if (lookupSocketByHandle(handle) != -1) {
         uint8_t resp = 3; // Duplicate handle error
-        sendPDU(sock, &resp, 1);
-        printf("[WARN] %s attempted registration with duplicate handle '%s'.\n", getClientIdentifier(sock), handle);
-        close(sock);
-        removeFromPollSet(sock);
+        struct iovec part = { &resp, 1 };
+        sendToClient(sock, &part, 1);
+        LOG_WARN("%s attempted registration with duplicate handle '%s'.", getClientIdentifier(sock), handle);
+        metricAdd(metricCounters[METRIC_REGISTRATION_REJECTS], 1);
+        closeClient(sock);
         return;
     }
 
-    /* Add the handle and its corresponding socket to the handle table */
-    addHandle(handle, sock);
-    {
-        uint8_t resp = 2; // Registration accepted response code
-        sendPDU(sock, &resp, 1);
+    /* A client registering again under a new handle leaves under its old one first */
+    char *oldHandle = lookupHandleBySocket(sock);
+    if (oldHandle != NULL) {
+        char old[MAX_HANDLE+1];
+        uint32_t oldId = lookupConnection(sock)->id;
+        strcpy(old, oldHandle);
+        removeHandleBySocket(sock);
+        publishPresence(21, old, oldId);
+    }
+
+    /* Add the handle and its corresponding socket to the handle table, which gives it an id */
+    uint32_t id = addHandle(handle, sock);
+    if (id == 0) {
+        uint8_t resp = 3; // No id left to give out
+        struct iovec part = { &resp, 1 };
+        sendToClient(sock, &part, 1);
+        LOG_WARN("%s could not register '%s': no client ids left.", getClientIdentifier(sock), handle);
+        metricAdd(metricCounters[METRIC_REGISTRATION_REJECTS], 1);
+        closeClient(sock);
+        return;
     }
     {
-        char ipStr[INET6_ADDRSTRLEN];
-        int clientPort;
-        getIPAndPort(sock, ipStr, sizeof(ipStr), &clientPort);
-        printf("Client: %s has joined the chat!\n\n", handle);
+        /* Registration accepted response: [flag=2][4-byte client id, network order] */
+        uint8_t resp[1 + 4];
+        uint32_t id_net = htonl(id);
+        resp[0] = 2;
+        memcpy(resp + 1, &id_net, 4);
+        struct iovec part = { resp, sizeof(resp) };
+        sendToClient(sock, &part, 1);
     }
+    eventLogRecord(EVENT_REGISTER, sock, id, buffer[0], len);
+    metricAdd(metricCounters[METRIC_REGISTRATIONS], 1);
+    publishPresence(20, handle, id);
+    LOG_INFO("Client: %s has joined the chat!", handle);
 }
 
 /*
@@ -287,6 +801,7 @@ void processRegistration(int sock, uint8_t *buffer, int len) {
  *   Packet format: [flag=4][sender_handle_length (1 byte)][sender handle][text message]
  *
  *   The server forwards this packet to every client except the one who sent it.
+ *   The packet is forwarded as received, header included, without being rebuilt.
  */
 void processBroadcast(int sock, uint8_t *buffer, int len) {
     int off = 1;  // Start offset after the flag byte
@@ -301,22 +816,24 @@ void processBroadcast(int sock, uint8_t *buffer, int len) {
     sender[shLen] = '\0';
     off += shLen;
 
-    printf("\n[INFO] Client '%s' (socket %d) is broadcasting a message.\n", sender, sock);
+    LOG_DEBUG("Client '%s' (socket %d) is broadcasting a message.", sender, sock);
+    eventLogRecord(EVENT_RELAY, sock, lookupConnection(sock)->id, buffer[0], len);
 
     /* Forward the broadcast packet to each client except the sender */
-    struct ClientEntry *entry = getHandleTableHead();
-    while (entry) {
-        if (entry->socket != sock)
-            sendPDU(entry->socket, buffer, len);
-        entry = entry->next;
+    const int *sockets = getHandleTableSockets();
+    unsigned int count = getHandleCount();
+    unsigned int recipients = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        if (sockets[i] != sock) {
+            forwardFrame(sockets[i], buffer - PDU_HEADER_LEN);
+            recipients++;
+        }
     }
-    /* Extract the text message from the packet (after the sender handle) */
-    char *msg = (char *)(buffer + off);
-    char ipStr[INET6_ADDRSTRLEN];
-    int port;
-    getIPAndPort(sock, ipStr, sizeof(ipStr), &port);
-    printf("Received packet from %s from socket %d (IP %s, port %d). Message has length %d with data: %s\n",
-           sender, sock, ipStr, port, len, msg);
+    metricObserve(&metricFanout, recipients);
+    /* The text message follows the sender handle */
+    LOG_DEBUG("Received packet from %s from socket %d (IP %s, port %d). Message has length %d with data: %s",
+              sender, sock, lookupConnection(sock)->peerIP, lookupConnection(sock)->peerPort, len,
+              (char *)(buffer + off));
 }
 
 /*
@@ -356,22 +873,22 @@ void processMessage(int sock, uint8_t *buffer, int len) {
     destHandle[dhLen] = '\0';
     off += dhLen;
 
-    printf("\n[INFO] Client '%s' (socket %d) is sending a private message to '%s'.\n", sender, sock, destHandle);
+    LOG_DEBUG("Client '%s' (socket %d) is sending a private message to '%s'.", sender, sock, destHandle);
+    eventLogRecord(EVENT_RELAY, sock, lookupConnection(sock)->id, buffer[0], len);
 
     /* Forward the message if the destination exists, otherwise send an error packet */
     int destSock = lookupSocketByHandle(destHandle);
-    if (destSock == -1)
+    if (destSock == -1) {
         sendErrorPacket(sock, destHandle);
-    else
-        sendPDU(destSock, buffer, len);
+    } else {
+        forwardFrame(destSock, buffer - PDU_HEADER_LEN);
+    }
+    metricObserve(&metricFanout, destSock == -1 ? 0 : 1);
 
-    /* Extract the text message from the packet (after the destination handle) */
-    char *msg = (char *)(buffer + off);
-    char ipStr[INET6_ADDRSTRLEN];
-    int port;
-    getIPAndPort(sock, ipStr, sizeof(ipStr), &port);
-    printf("Received packet from %s from socket %d (IP %s, port %d). Message has length %d with data: %s\n",
-           sender, sock, ipStr, port, len, msg);
+    /* The text message follows the destination handle */
+    LOG_DEBUG("Received packet from %s from socket %d (IP %s, port %d). Message has length %d with data: %s",
+              sender, sock, lookupConnection(sock)->peerIP, lookupConnection(sock)->peerPort, len,
+              (char *)(buffer + off));
 }
 
 /*
@@ -385,7 +902,8 @@ void processMessage(int sock, uint8_t *buffer, int len) {
  *
  *   For each destination, the server attempts to look up the destination handle.
  *   If found, the message is forwarded. If not, an error packet is sent back to the sender.
- *   Note: The text message is sent in its entirety with every forwarded packet.
+ *   Note: The text message is sent in its entirety with every forwarded packet, which is
+ *   the packet exactly as received.
  */
 void processMulticast(int sock, uint8_t *buffer, int len) {
     int off = 1;  // Start offset after the flag byte
@@ -402,68 +920,405 @@ void processMulticast(int sock, uint8_t *buffer, int len) {
     if (len < off + 1) return;
     uint8_t numDest = buffer[off++];
 
-    printf("\n[INFO] Client '%s' (socket %d) is sending a multicast message to %d destination(s).\n", sender, sock, numDest);
+    LOG_DEBUG("Client '%s' (socket %d) is sending a multicast message to %d destination(s).", sender, sock, numDest);
+    eventLogRecord(EVENT_RELAY, sock, lookupConnection(sock)->id, buffer[0], len);
 
     /* Loop through each destination */
+    int truncated = 0;
+    int recipients = 0;
     for (int i = 0; i < numDest; i++) {
-        if (len < off + 1) return;
+        if (len < off + 1 || len < off + 1 + buffer[off]) {
+            truncated = 1;
+            break;
+        }
         uint8_t dlen = buffer[off++];
         char destHandle[MAX_HANDLE+1] = {0};
-        if (len < off + dlen) return;
         memcpy(destHandle, buffer + off, dlen);
         destHandle[dlen] = '\0';
         off += dlen;
 
         int destSock = lookupSocketByHandle(destHandle);
         if (destSock == -1) {
-            printf("[WARN] Destination '%s' not found for multicast message from '%s'.\n", destHandle, sender);
+            LOG_DEBUG("Destination '%s' not found for multicast message from '%s'.", destHandle, sender);
             sendErrorPacket(sock, destHandle);
         } else {
-            sendPDU(destSock, buffer, len);
+            forwardFrame(destSock, buffer - PDU_HEADER_LEN);
+            recipients++;
         }
     }
-    /* Extract the text message from the packet (after the sender handle) */
-    char *msg = (char *)(buffer + off);
-    char ipStr[INET6_ADDRSTRLEN];
-    int port;
-    getIPAndPort(sock, ipStr, sizeof(ipStr), &port);
-    printf("Received packet from %s from socket %d (IP %s, port %d). Message has length %d with data: %s\n",
-           sender, sock, ipStr, port, len, msg);
+    metricObserve(&metricFanout, recipients);
+    if (truncated) return;
+
+    /* The text message follows the sender handle */
+    LOG_DEBUG("Received packet from %s from socket %d (IP %s, port %d). Message has length %d with data: %s",
+              sender, sock, lookupConnection(sock)->peerIP, lookupConnection(sock)->peerPort, len,
+              (char *)(buffer + off));
+}
+
+/*
+ * processIdMessage:
+ *   Processes a private message (flag=8) or multicast (flag=9) packet addressed by client id.
+ *   Packet format: [flag=8 or 9][sender_handle_length][sender handle]
+ *                  [number_of_destinations (1 byte, exactly 1 for flag=8)]
+ *                  For each destination:
+ *                     [dest id (4 bytes, network order)]
+ *                  [text message]
+ *
+ *   Handled like flag=5 and flag=6, but each destination is resolved with lookupById(): one
+ *   array access, no hashing or comparing of handle strings. Clients learn the ids from list
+ *   and presence responses asked for with LIST_IDS. For an id that is not (or no longer)
+ *   registered, an error packet carrying it is sent back to the sender (see sendIdErrorPacket()).
+ *   The packet is forwarded exactly as received.
+ */
+void processIdMessage(int sock, uint8_t *buffer, int len) {
+    int off = 1;  // Start offset after the flag byte
+    /* Retrieve sender handle length and sender handle */
+    if (len < off + 1) return;
+    uint8_t shLen = buffer[off++];
+    char sender[MAX_HANDLE+1] = {0};
+    if (len < off + shLen) return;
+    memcpy(sender, buffer + off, shLen);
+    sender[shLen] = '\0';
+    off += shLen;
+
+    /* Get the number of destination ids, and make sure all of them are there */
+    if (len < off + 1) return;
+    uint8_t numDest = buffer[off++];
+    if (buffer[0] == 8 && numDest != 1) return;  // A private message has exactly one destination
+    if (len < off + 4 * numDest) return;
+
+    LOG_DEBUG("Client '%s' (socket %d) is sending a message to %d destination id(s).", sender, sock, numDest);
+    eventLogRecord(EVENT_RELAY, sock, lookupConnection(sock)->id, buffer[0], len);
+
+    int recipients = 0;
+    for (int i = 0; i < numDest; i++) {
+        uint32_t id_net;
+        memcpy(&id_net, buffer + off, 4);
+        off += 4;
+
+        struct ClientEntry *dest = lookupById(ntohl(id_net));
+        if (dest == NULL) {
+            LOG_DEBUG("Destination id %u not found for message from '%s'.", ntohl(id_net), sender);
+            sendIdErrorPacket(sock, ntohl(id_net));
+        } else {
+            forwardFrame(dest->socket, buffer - PDU_HEADER_LEN);
+            recipients++;
+        }
+    }
+    metricObserve(&metricFanout, recipients);
+
+    /* The text message follows the destination ids */
+    LOG_DEBUG("Received packet from %s from socket %d (IP %s, port %d). Message has length %d with data: %s",
+              sender, sock, lookupConnection(sock)->peerIP, lookupConnection(sock)->peerPort, len,
+              (char *)(buffer + off));
 }
 
 /*
  * processListRequest:
  *   Processes a list request packet from a client.
  *   The client sends a packet with flag=10 to request the list of all connected client handles.
+ *   Packet format: [flag=10][options (1 byte, optional)]
  *
  *   The server responds with three parts:
  *     1. A packet with flag=11 containing a 4-byte count (number of registered handles).
- *     2. One packet per handle, each with flag=12 containing:
+ *     2. The handles, in sorted order: without LIST_PACKED in the options, one packet per
+ *        handle, each with flag=12 containing:
  *          [handle_length (1 byte)][handle]
+ *        With it, packets with flag=15, each holding as many handles as fit in one PDU:
+ *          [handle_length (1 byte)][handle][handle_length (1 byte)][handle]...
+ *        With LIST_IDS in the options, every handle (in either layout) is followed by the
+ *        client's id: [handle_length (1 byte)][handle][id (4 bytes, network order)]
  *     3. A final packet with flag=13 to mark the end of the list.
+ *
+ *   All three are sent from the cached listResponse of that layout, rebuilt first if the
+ *   membership has changed since it was built.
  */
 void processListRequest(int sock, uint8_t *buffer, int len) {
-    uint32_t count = getHandleCount();
+    int options = len >= 2 ? buffer[1] & (LIST_PACKED | LIST_IDS) : 0;
+
+    if (listResponse[options] == NULL || listResponseVersion[options] != getHandleTableVersion()) {
+        /* Clients still sending the old response keep their own references to it */
+        if (listResponse[options] != NULL)
+            pduFrameRelease(listResponse[options]);
+        listResponse[options] = buildListResponse(getSortedHandles(), (options & LIST_IDS) ? getSortedIds() : NULL,
+                                                  getHandleCount(), options & LIST_PACKED, NULL);
+        listResponseVersion[options] = getHandleTableVersion();
+    }
+    sendFrameToClient(sock, listResponse[options]);
+}
+
+/*
+ * processPrefixListRequest:
+ *   Processes a prefix list request packet from a client.
+ *   Packet format: [flag=14][prefix_length (1 byte)][prefix][max count (4 bytes, network order)]
+ *                  [options (1 byte, optional)]
+ *
+ *   The response has the same three parts (and options) as for flag=10, but lists only the handles that
+ *   start with the prefix (all of them for an empty prefix), in sorted order, and no more
+ *   than max count of them (0 means no limit). The count in the flag=11 packet is the number
+ *   of handles actually listed. The matches are found in the table's sorted index, so only
+ *   they are read, never the rest of the table.
+ */
+void processPrefixListRequest(int sock, uint8_t *buffer, int len) {
+    if (len < 2) return;
+    uint8_t plen = buffer[1];
+    if (plen > MAX_HANDLE || len < 2 + plen + 4) {
+        LOG_WARN("%s sent a malformed prefix list request.", getClientIdentifier(sock));
+        return;
+    }
+    char prefix[MAX_HANDLE+1];
+    memcpy(prefix, buffer + 2, plen);
+    prefix[plen] = '\0';
+    uint32_t max_net;
+    memcpy(&max_net, buffer + 2 + plen, 4);
+    uint32_t max = ntohl(max_net);
+    uint8_t options = len >= 2 + plen + 4 + 1 ? buffer[2 + plen + 4] : 0;
+
+    unsigned int first;
+    unsigned int count = findHandlesByPrefix(prefix, &first);
+    if (max != 0 && count > max)
+        count = max;
+
+    struct pduFrame *frame = buildListResponse(getSortedHandles() + first,
+                                               (options & LIST_IDS) ? getSortedIds() + first : NULL,
+                                               count, options & LIST_PACKED, NULL);
+    sendFrameToClient(sock, frame);
+    pduFrameRelease(frame);
+}
+
+/*
+ * processPagedListRequest:
+ *   Processes a paged list request packet from a client.
+ *   Packet format: [flag=16][cursor_length (1 byte)][cursor][page size (4 bytes, network order)]
+ *                  [options (1 byte, optional)]
+ *
+ *   The response has the same three parts (and options) as for flag=10, but lists only the
+ *   next page: up to page size handles (LIST_PAGE_MAX for 0 or anything larger) that sort
+ *   after the cursor, starting from the first handle for an empty cursor. Its flag=13
+ *   packet carries the cursor for the following page:
+ *     [flag=13][cursor_length (1 byte)][cursor]
+ *   with an empty cursor once the last page has been sent.
+ *
+ *   The cursor is the last handle of the page, and each page is looked up in the table's
+ *   sorted index from there, so no state is kept between requests and a listing stays
+ *   consistent while clients come and go: every handle registered for the whole listing
+ *   is sent exactly once, in order; one that joins or leaves meanwhile may or may not be.
+ *   A client can thus fetch a huge roster one bounded page at a time, its chat traffic
+ *   getting through in between.
+ */
+void processPagedListRequest(int sock, uint8_t *buffer, int len) {
+    if (len < 2) return;
+    uint8_t clen = buffer[1];
+    if (clen > MAX_HANDLE || len < 2 + clen + 4) {
+        LOG_WARN("%s sent a malformed paged list request.", getClientIdentifier(sock));
+        return;
+    }
+    char cursor[MAX_HANDLE+1];
+    memcpy(cursor, buffer + 2, clen);
+    cursor[clen] = '\0';
+    uint32_t pageSize_net;
+    memcpy(&pageSize_net, buffer + 2 + clen, 4);
+    uint32_t pageSize = ntohl(pageSize_net);
+    if (pageSize == 0 || pageSize > LIST_PAGE_MAX)
+        pageSize = LIST_PAGE_MAX;
+    uint8_t options = len >= 2 + clen + 4 + 1 ? buffer[2 + clen + 4] : 0;
+
+    unsigned int first = clen ? findHandlesAfter(cursor) : 0;
+    unsigned int count = getHandleCount() - first;
+    char *const *page = getSortedHandles() + first;
+    const char *next = "";
+    if (count > pageSize) {
+        count = pageSize;
+        next = page[count - 1];
+    }
+
+    struct pduFrame *frame = buildListResponse(page, (options & LIST_IDS) ? getSortedIds() + first : NULL,
+                                               count, options & LIST_PACKED, next);
+    sendFrameToClient(sock, frame);
+    pduFrameRelease(frame);
+}
+
+/*
+ * buildListResponse:
+ *   Encodes the flag=11, flag=12 (one per handle, in the order given) or flag=15 (packed)
+ *   and flag=13 packets of a list response into one new frame, sized exactly for them.
+ *   If 'ids' is not NULL, each handle is followed by its id from there (LIST_IDS).
+ *   If 'next' is not NULL, the flag=13 packet carries it as the cursor of the next page.
+ */
+struct pduFrame *buildListResponse(char *const *handles, const uint32_t *ids, unsigned int count, int packed,
+                                   const char *next) {
+    int idLength = ids ? 4 : 0;
+    int size = PDU_HEADER_LEN + 1 + 4 + PDU_HEADER_LEN + 1;
+    if (next)
+        size += 1 + strlen(next);
+    if (packed) {
+        /* Same packing as below, only adding up the packet sizes */
+        int fill = 1;
+        for (unsigned int i = 0; i < count; i++) {
+            int entry = 1 + strlen(handles[i]) + idLength;
+            if (fill + entry > PDU_MAX_PAYLOAD) {
+                size += PDU_HEADER_LEN + fill;
+                fill = 1;
+            }
+            fill += entry;
+        }
+        if (fill > 1)
+            size += PDU_HEADER_LEN + fill;
+    } else {
+        for (unsigned int i = 0; i < count; i++)
+            size += PDU_HEADER_LEN + 2 + strlen(handles[i]) + idLength;
+    }
+    struct pduFrame *frame = pduFrameAlloc(size);
+
     uint32_t count_net = htonl(count);
     uint8_t resp[1 + 4];
     resp[0] = 11;  // Flag for "list count" packet
     memcpy(resp + 1, &count_net, 4);
-    sendPDU(sock, resp, sizeof(resp));
+    struct iovec part = { resp, sizeof(resp) };
+    pduFrameAppendv(frame, &part, 1);
 
-    struct ClientEntry *entry = getHandleTableHead();
-    while (entry) {
-        uint8_t pkt[1 + 1 + MAX_HANDLE];  // Buffer for the packet: flag + handle length + handle string
-        int off = 0;
-        pkt[off++] = 12;  // Flag for "list handle" packet
-        uint8_t hlen = (uint8_t) strlen(entry->handle);
-        pkt[off++] = hlen;
-        memcpy(pkt + off, entry->handle, hlen);
-        off += hlen;
-        sendPDU(sock, pkt, off);
-        entry = entry->next;
+    if (packed) {
+        /* Fill each flag=15 packet with [length][handle]([id]) entries up to PDU_MAX_PAYLOAD */
+        uint8_t pkt[PDU_MAX_PAYLOAD];
+        int fill = 1;
+        pkt[0] = 15;  // Flag for "packed list handles" packet
+        for (unsigned int i = 0; i < count; i++) {
+            int hlen = strlen(handles[i]);
+            if (fill + 1 + hlen + idLength > PDU_MAX_PAYLOAD) {
+                part.iov_base = pkt;
+                part.iov_len = fill;
+                pduFrameAppendv(frame, &part, 1);
+                fill = 1;
+            }
+            pkt[fill++] = (uint8_t) hlen;
+            memcpy(pkt + fill, handles[i], hlen);
+            fill += hlen;
+            if (ids) {
+                uint32_t id_net = htonl(ids[i]);
+                memcpy(pkt + fill, &id_net, 4);
+                fill += 4;
+            }
+        }
+        if (fill > 1) {
+            part.iov_base = pkt;
+            part.iov_len = fill;
+            pduFrameAppendv(frame, &part, 1);
+        }
+    } else {
+        for (unsigned int i = 0; i < count; i++) {
+            uint8_t head[2];
+            head[0] = 12;  // Flag for "list handle" packet
+            head[1] = (uint8_t) strlen(handles[i]);
+            uint32_t id_net = ids ? htonl(ids[i]) : 0;
+            struct iovec parts[3] = { { head, 2 }, { handles[i], head[1] }, { &id_net, idLength } };
+            pduFrameAppendv(frame, parts, 3);
+        }
+    }
+    uint8_t finish[2];
+    finish[0] = 13;
+    if (next) {
+        finish[1] = (uint8_t) strlen(next);
+        struct iovec parts[2] = { { finish, 2 }, { (void *) next, finish[1] } };
+        pduFrameAppendv(frame, parts, 2);
+    } else {
+        part.iov_base = finish;
+        part.iov_len = 1;
+        pduFrameAppendv(frame, &part, 1);
     }
-    uint8_t finish = 13;
-    sendPDU(sock, &finish, 1);
+    return frame;
+}
+
+/*
+ * processPresenceRequest:
+ *   Processes a presence packet from a client.
+ *   Packet format: [flag=18][subscribe (1 byte): 1 = subscribe, 0 = unsubscribe][list options (1 byte, optional)]
+ *
+ *   On subscribing (again, e.g. to resync after a gap), the client gets a snapshot:
+ *     1. A packet with flag=19 containing the 4-byte membership version (network order).
+ *     2. The list response for flag=10 (with the given options) of that same version.
+ *   From then on every join and leave is pushed to it as it happens:
+ *     [flag=20 (join) or flag=21 (leave)][version (4 bytes)][handle_length (1 byte)][handle]
+ *   followed by the client's id (4 bytes, network order) if the options include LIST_IDS.
+ *   The version of each delta is the one after that change, which is one more than the
+ *   version before it, so a subscriber that sees any other step has missed something and
+ *   should subscribe again.
+ */
+void processPresenceRequest(int sock, uint8_t *buffer, int len) {
+    if (len < 2) return;
+    struct ClientEntry *client = lookupConnection(sock);
+
+    if (buffer[1] == 0) {
+        unsubscribePresence(sock);
+        return;
+    }
+    if (!client->subscribed) {
+        if (subscriberCount == subscriberSize) {
+            subscriberSize = subscriberSize ? subscriberSize * 2 : 64;
+            subscribers = srealloc(subscribers, subscriberSize * sizeof(int));
+        }
+        client->subscribed = 1;
+        client->subscriberIndex = subscriberCount;
+        subscribers[subscriberCount++] = sock;
+    }
+    client->presenceIds = len >= 3 && (buffer[2] & LIST_IDS);
+
+    uint8_t resp[1 + 4];
+    uint32_t version_net = htonl(getHandleTableVersion());
+    resp[0] = 19;
+    memcpy(resp + 1, &version_net, 4);
+    struct iovec part = { resp, sizeof(resp) };
+    sendToClient(sock, &part, 1);
+    /* The rest of the snapshot is an ordinary list response, options and all */
+    processListRequest(sock, buffer + 1, len - 1);
+}
+
+/*
+ * unsubscribePresence:
+ *   Stops presence deltas to the client (if it was subscribed).
+ */
+void unsubscribePresence(int sock) {
+    struct ClientEntry *client = lookupConnection(sock);
+
+    if (!client->subscribed)
+        return;
+    int last = subscribers[--subscriberCount];
+    subscribers[client->subscriberIndex] = last;
+    lookupConnection(last)->subscriberIndex = client->subscriberIndex;
+    client->subscribed = 0;
+}
+
+/*
+ * publishPresence:
+ *   Pushes a join (flag=20) or leave (flag=21) of 'handle' (registered under 'id'), stamped
+ *   with the current membership version, to every presence subscriber. Call right after
+ *   the change. The delta is framed at most twice: without the id and with it (LIST_IDS).
+ */
+void publishPresence(uint8_t flag, const char *handle, uint32_t id) {
+    if (subscriberCount == 0)
+        return;
+
+    uint8_t head[1 + 4 + 1];
+    uint32_t version_net = htonl(getHandleTableVersion());
+    uint32_t id_net = htonl(id);
+    head[0] = flag;
+    memcpy(head + 1, &version_net, 4);
+    head[5] = (uint8_t) strlen(handle);
+    struct iovec parts[3] = { { head, sizeof(head) }, { (void *) handle, head[5] }, { &id_net, 4 } };
+    struct pduFrame *frames[2] = { NULL, NULL };  // without and with the id
+
+    for (int i = 0; i < subscriberCount; i++) {
+        int withId = lookupConnection(subscribers[i])->presenceIds;
+        if (frames[withId] == NULL) {
+            frames[withId] = pduFrameAlloc(PDU_HEADER_LEN + sizeof(head) + head[5] + 4 * withId);
+            pduFrameAppendv(frames[withId], parts, 2 + withId);
+        }
+        sendFrameToClient(subscribers[i], frames[withId]);
+    }
+    for (int withId = 0; withId < 2; withId++)
+        if (frames[withId] != NULL)
+            pduFrameRelease(frames[withId]);
+    /* Also called outside packet handling (a client closing) */
+    flushFanout();
 }
 
 /*
@@ -472,13 +1327,67 @@ void processListRequest(int sock, uint8_t *buffer, int len) {
  *   Error packet format: [flag=7][dest_handle_length (1 byte)][dest handle]
  */
 void sendErrorPacket(int sock, const char *destHandle) {
-    uint8_t pkt[1 + 1 + MAX_HANDLE];
-    int off = 0;
-    pkt[off++] = 7;
-    uint8_t hlen = (uint8_t) strlen(destHandle);
-    pkt[off++] = hlen;
-    memcpy(pkt + off, destHandle, hlen);
-    off += hlen;
-    sendPDU(sock, pkt, off);
-    printf("\n[INFO] Sent error packet to %s: destination handle '%s' not found.\n", getClientIdentifier(sock), destHandle);
+    uint8_t head[2];
+    head[0] = 7;
+    head[1] = (uint8_t) strlen(destHandle);
+    struct iovec parts[2] = { { head, 2 }, { (void *) destHandle, head[1] } };
+    sendToClient(sock, parts, 2);
+    eventLogRecord(EVENT_ERROR, sock, lookupConnection(sock)->id, head[0], 2 + head[1]);
+    LOG_DEBUG("Sent error packet to %s: destination handle '%s' not found.", getClientIdentifier(sock), destHandle);
+}
+
+/*
+ * sendIdErrorPacket:
+ *   Sends an error packet back to a client when a destination id is not registered.
+ *   Error packet format: [flag=17][dest id (4 bytes, network order)]
+ */
+void sendIdErrorPacket(int sock, uint32_t destId) {
+    uint8_t resp[1 + 4];
+    uint32_t id_net = htonl(destId);
+    resp[0] = 17;
+    memcpy(resp + 1, &id_net, 4);
+    struct iovec part = { resp, sizeof(resp) };
+    sendToClient(sock, &part, 1);
+    eventLogRecord(EVENT_ERROR, sock, lookupConnection(sock)->id, resp[0], sizeof(resp));
+    LOG_DEBUG("Sent error packet to %s: destination id %u not found.", getClientIdentifier(sock), destId);
+}
+
+/*
+ * collectGauges:
+ *   Supplies the current values of the server's gauges for a metrics scrape
+ *   (the metrics listener's gauge source).
+ *
+ * Returns:
+ *   The number of gauges filled in.
+ *
+ * Operation:
+ *   - Walks the connection table once, counting the open connections and summing
+ *     the bytes waiting in their outbound queues.
+ */
+int collectGauges(struct metricGauge *gauges, int max) {
+    int connected = 0;
+    long long queued = 0;
+    int size = getConnectionTableSize();
+
+    for (int sock = 0; sock < size; sock++) {
+        struct ClientEntry *client = lookupConnection(sock);
+        if (client != NULL) {
+            connected++;
+            queued += client->outbound.pending;
+        }
+    }
+
+    struct metricGauge current[] = {
+        { "chat_connected_clients", "Open client connections, registered or not.", connected },
+        { "chat_registered_handles", "Handles in the handle table.", getHandleCount() },
+        { "chat_outbound_queued_bytes", "Bytes queued for clients that cannot take them yet.", (double) queued },
+        { "chat_backlogged_clients", "Clients with input left over for the next pass.", backlogCount },
+        { "chat_presence_subscribers", "Clients subscribed to presence deltas.", subscriberCount },
+    };
+    int count = sizeof(current) / sizeof(current[0]);
+
+    if (count > max)
+        count = max;
+    memcpy(gauges, current, count * sizeof(struct metricGauge));
+    return count;
 }
@@ -0,0 +1,39 @@
+#!/bin/bash
+#
+# stdinFile.sh
+#
+# cclient with its stdin redirected from a regular file and from /dev/null
+# (descriptors epoll refuses): the commands in the file must be sent, and
+# end of file must end the client normally.
+#
+# Usage: tests/stdinFile.sh (from the top directory, after make)
+
+cd "$(dirname "$0")/.." || exit 1
+work=$(mktemp -d)
+trap 'kill $server 2>/dev/null; rm -rf "$work"' EXIT
+
+./server 0 > "$work/server.log" 2>&1 &
+server=$!
+for i in $(seq 50); do
+    port=$(grep -o '[0-9]\+' "$work/server.log" | head -1)
+    [ -n "$port" ] && break
+    sleep 0.1
+done
+[ -n "$port" ] || { echo "FAIL: server did not start"; exit 1; }
+
+sleep 2 | ./cclient bob localhost "$port" > "$work/bob.log" 2>&1 &
+reader=$!
+sleep 0.3
+
+printf '%%M bob hello from a file\n' > "$work/commands"
+./cclient alice localhost "$port" < "$work/commands" > "$work/alice.log" 2>&1
+status=$?
+[ $status -eq 0 ] || { echo "FAIL: cclient < file exited with $status"; cat "$work/alice.log"; exit 1; }
+
+./cclient carol localhost "$port" < /dev/null > "$work/carol.log" 2>&1
+status=$?
+[ $status -eq 0 ] || { echo "FAIL: cclient < /dev/null exited with $status"; cat "$work/carol.log"; exit 1; }
+
+wait $reader
+grep -q "hello from a file" "$work/bob.log" || { echo "FAIL: message from the file not delivered"; cat "$work/bob.log"; exit 1; }
+echo "PASS"